@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libopencm3/stm32/adc.h>
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
+
+#include "adc.h"
+#include "systick.h"
+
+#define ADC1_DMA 1
+
+/* Number of conversions of each input kept in the buffer */
+#define ADC_DEPTH 32
+
+/*
+ * TIM1 is slaved to the PWM timer's update event, and its CC1 triggers
+ * the conversions. In quadrature encoder builds TIM1 is busy, so the ADC
+ * free-runs instead.
+ */
+#define ADC_TRIGGER_TIMER TIM1
+
+static uint8_t adc_sequence[ADC_N_INPUTS] = {
+	[ADC_MOTOR_A_CURRENT] = 8,
+#ifndef BATTERY_SENSE
+	[ADC_MOTOR_B_CURRENT] = 9,
+#else
+	[ADC_BATTERY] = 9,
+#endif
+};
+
+#ifdef PERIOD_COUNTER_DMA
+/*
+ * TIM4 CH1 capture needs DMA1 channel 1, so the inputs are converted as the
+ * injected group instead, triggered directly by the PWM timer's update.
+ * Only the latest conversion is available. The pwm_timer must be TIM2.
+ */
+void adc_sync_pwm(uint32_t pwm_timer)
+{
+	(void)pwm_timer;
+}
+
+/* Conversions always start at the update event */
+void adc_set_sample_point(uint16_t count)
+{
+	(void)count;
+}
+
+static void adc_init_conversions(uint32_t pwm_timer)
+{
+	timer_set_master_mode(pwm_timer, TIM_CR2_MMS_UPDATE);
+
+	adc_set_injected_sequence(ADC1, ADC_N_INPUTS, adc_sequence);
+	adc_enable_external_trigger_injected(ADC1, ADC_CR2_JEXTSEL_TIM2_TRGO);
+}
+
+uint16_t adc_get(enum adc_input input)
+{
+	if (input >= ADC_N_INPUTS) {
+		return 0;
+	}
+
+	return adc_read_injected(ADC1, input + 1);
+}
+#else
+static volatile uint16_t adc_buf[ADC_DEPTH][ADC_N_INPUTS];
+
+static void adc_init_dma(void)
+{
+	dma_channel_reset(DMA1, ADC1_DMA);
+	dma_disable_channel(DMA1, ADC1_DMA);
+	dma_set_read_from_peripheral(DMA1, ADC1_DMA);
+	dma_set_memory_size(DMA1, ADC1_DMA, DMA_CCR_MSIZE_16BIT);
+	dma_set_peripheral_size(DMA1, ADC1_DMA, DMA_CCR_PSIZE_16BIT);
+	dma_enable_memory_increment_mode(DMA1, ADC1_DMA);
+	dma_disable_peripheral_increment_mode(DMA1, ADC1_DMA);
+	dma_enable_circular_mode(DMA1, ADC1_DMA);
+	dma_set_peripheral_address(DMA1, ADC1_DMA, (uint32_t)&(ADC_DR(ADC1)));
+	dma_set_memory_address(DMA1, ADC1_DMA, (uint32_t)adc_buf);
+	dma_set_number_of_data(DMA1, ADC1_DMA, ADC_DEPTH * ADC_N_INPUTS);
+	dma_enable_channel(DMA1, ADC1_DMA);
+}
+
+#ifndef QUADRATURE_ENCODER
+static bool adc_centre_aligned;
+
+void adc_sync_pwm(uint32_t pwm_timer)
+{
+	timer_set_prescaler(ADC_TRIGGER_TIMER, TIM_PSC(pwm_timer));
+
+	adc_centre_aligned = TIM_CR1(pwm_timer) & TIM_CR1_CMS_MASK;
+	if (adc_centre_aligned) {
+		/*
+		 * Centre-aligned updates at the top and bottom of the count,
+		 * which are the middles of the pulses.
+		 */
+		timer_set_oc_value(ADC_TRIGGER_TIMER, TIM_OC1, 1);
+	} else {
+		/* Until adc_set_sample_point(), the middle of the PWM period */
+		timer_set_oc_value(ADC_TRIGGER_TIMER, TIM_OC1, TIM_ARR(pwm_timer) / 2);
+	}
+}
+
+void adc_set_sample_point(uint16_t count)
+{
+	if (adc_centre_aligned) {
+		return;
+	}
+
+	/* The compare event has to happen after the reset at 0 */
+	timer_set_oc_value(ADC_TRIGGER_TIMER, TIM_OC1, count ? count : 1);
+}
+
+static void adc_init_trigger(uint32_t pwm_timer)
+{
+	timer_set_master_mode(pwm_timer, TIM_CR2_MMS_UPDATE);
+
+	timer_reset(ADC_TRIGGER_TIMER);
+	timer_set_mode(ADC_TRIGGER_TIMER, TIM_CR1_CKD_CK_INT,
+		       TIM_CR1_CMS_EDGE, TIM_CR1_DIR_UP);
+	timer_set_period(ADC_TRIGGER_TIMER, 0xffff);
+	/* TIM1 ITR1 is TIM2's TRGO */
+	timer_slave_set_trigger(ADC_TRIGGER_TIMER, TIM_SMCR_TS_ITR1);
+	timer_slave_set_mode(ADC_TRIGGER_TIMER, TIM_SMCR_SMS_RM);
+
+	/* The compare event needs the channel enabled, but MOE stays off */
+	timer_set_oc_mode(ADC_TRIGGER_TIMER, TIM_OC1, TIM_OCM_PWM1);
+	timer_enable_oc_output(ADC_TRIGGER_TIMER, TIM_OC1);
+
+	adc_sync_pwm(pwm_timer);
+	timer_enable_counter(ADC_TRIGGER_TIMER);
+
+	adc_set_single_conversion_mode(ADC1);
+	adc_enable_external_trigger_regular(ADC1, ADC_CR2_EXTSEL_TIM1_CC1);
+}
+#else
+void adc_sync_pwm(uint32_t pwm_timer)
+{
+	(void)pwm_timer;
+}
+
+void adc_set_sample_point(uint16_t count)
+{
+	(void)count;
+}
+
+static void adc_init_trigger(uint32_t pwm_timer)
+{
+	(void)pwm_timer;
+
+	adc_set_continuous_conversion_mode(ADC1);
+	adc_enable_external_trigger_regular(ADC1, ADC_CR2_EXTSEL_SWSTART);
+}
+#endif
+
+static void adc_init_conversions(uint32_t pwm_timer)
+{
+	adc_set_regular_sequence(ADC1, ADC_N_INPUTS, adc_sequence);
+	adc_init_trigger(pwm_timer);
+	adc_enable_dma(ADC1);
+
+	adc_init_dma();
+}
+
+uint16_t adc_get(enum adc_input input)
+{
+	uint32_t sum = 0;
+	unsigned int i;
+
+	if (input >= ADC_N_INPUTS) {
+		return 0;
+	}
+
+	for (i = 0; i < ADC_DEPTH; i++) {
+		sum += adc_buf[i][input];
+	}
+
+	return sum / ADC_DEPTH;
+}
+#endif /* PERIOD_COUNTER_DMA */
+
+void adc_init(uint32_t pwm_timer)
+{
+	rcc_periph_clock_enable(RCC_ADC1);
+	/* ADC clock must be <= 14 MHz */
+	rcc_set_adcpre(RCC_CFGR_ADCPRE_PCLK2_DIV6);
+
+	gpio_set_mode(GPIOB, GPIO_MODE_INPUT, GPIO_CNF_INPUT_ANALOG,
+		      GPIO0 | GPIO1);
+
+	adc_power_off(ADC1);
+	adc_enable_scan_mode(ADC1);
+	adc_set_right_aligned(ADC1);
+	adc_set_sample_time_on_all_channels(ADC1, ADC_SMPR_SMP_28DOT5CYC);
+	adc_init_conversions(pwm_timer);
+
+	adc_power_on(ADC1);
+	delay_us(10);
+	adc_reset_calibration(ADC1);
+	adc_calibrate(ADC1);
+
+#if defined(QUADRATURE_ENCODER) && !defined(PERIOD_COUNTER_DMA)
+	adc_start_conversion_regular(ADC1);
+#endif
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __ADC_H__
+#define __ADC_H__
+
+#include <stdint.h>
+
+/*
+ * Inputs, in the order they are converted. PB0 and PB1 are the only free
+ * ADC pins on the Blue Pill, so battery sensing takes over PB1 from motor
+ * B's current. Inputs which aren't connected always read as 0.
+ */
+enum adc_input {
+	ADC_MOTOR_A_CURRENT = 0, /* PB0, ADC_IN8 */
+#ifndef BATTERY_SENSE
+	ADC_MOTOR_B_CURRENT,     /* PB1, ADC_IN9 */
+	ADC_N_INPUTS,
+	ADC_BATTERY = ADC_N_INPUTS,
+#else
+	ADC_BATTERY,             /* PB1, ADC_IN9 */
+	ADC_N_INPUTS,
+	ADC_MOTOR_B_CURRENT = ADC_N_INPUTS,
+#endif
+};
+
+/*
+ * Start sampling all inputs into a circular DMA buffer. Conversions are
+ * triggered half-way through each PWM period of pwm_timer, or at the middle
+ * of the pulses if it's centre-aligned.
+ */
+void adc_init(uint32_t pwm_timer);
+/* Re-synchronise the trigger after changing the PWM frequency or mode */
+void adc_sync_pwm(uint32_t pwm_timer);
+/*
+ * Trigger the conversions 'count' PWM timer counts into each period, so
+ * they land while the motors are being driven. This follows the duty, so
+ * is meant to be called every control tick. Only used when edge-aligned,
+ * centre-aligned always samples in the middle of the pulses.
+ */
+void adc_set_sample_point(uint16_t count);
+/*
+ * Mean of the most recent samples of input (raw 12-bit counts). Only the
+ * latest sample with PERIOD_COUNTER_DMA.
+ */
+uint16_t adc_get(enum adc_input input);
+
+#endif /* __ADC_H__ */
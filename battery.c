@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+
+#include "battery.h"
+
+/* Low-pass filter coefficient is 1 / 2^BATTERY_FILTER */
+#define BATTERY_FILTER 3
+
+/*
+ * Don't compensate below half of nominal. It's probably not connected, and
+ * we'd just be multiplying noise.
+ */
+#define BATTERY_MIN_RATIO 2
+
+static struct battery {
+	uint32_t scale;     /* mV per ADC count, Q16.16 */
+	uint16_t offset;    /* ADC counts at 0 V */
+	uint32_t nominal;   /* mV */
+	uint32_t filtered;  /* mV, Q16.16 */
+	uint32_t gain;      /* Q16.16 */
+} battery;
+
+static void battery_update_gain(void)
+{
+	uint32_t mv = battery_get_mv();
+
+	if (!battery.nominal || mv < battery.nominal / BATTERY_MIN_RATIO) {
+		battery.gain = 1 << 16;
+		return;
+	}
+
+	battery.gain = ((uint64_t)battery.nominal << 16) / mv;
+}
+
+void battery_init(uint32_t scale, uint16_t offset)
+{
+	battery.scale = scale;
+	battery.offset = offset;
+	battery.nominal = 0;
+	battery.filtered = 0;
+	battery.gain = 1 << 16;
+}
+
+void battery_set_nominal(uint32_t nominal)
+{
+	battery.nominal = nominal;
+	battery_update_gain();
+}
+
+void battery_update(uint16_t raw)
+{
+	uint32_t mv = 0;
+
+	if (raw > battery.offset) {
+		/* Q16.16 */
+		mv = (raw - battery.offset) * battery.scale;
+	}
+
+	/* Exponential moving average */
+	if (mv > battery.filtered) {
+		battery.filtered += (mv - battery.filtered) >> BATTERY_FILTER;
+	} else {
+		battery.filtered -= (battery.filtered - mv) >> BATTERY_FILTER;
+	}
+
+	battery_update_gain();
+}
+
+uint32_t battery_get_mv(void)
+{
+	return battery.filtered >> 16;
+}
+
+uint16_t battery_compensate(uint16_t duty)
+{
+	uint32_t ret = ((uint64_t)duty * battery.gain) >> 16;
+
+	return ret > 0xffff ? 0xffff : ret;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __BATTERY_H__
+#define __BATTERY_H__
+
+#include <stdint.h>
+
+/*
+ * Battery voltage measurement and duty compensation. Duty values passed to
+ * battery_compensate() are treated as being relative to the nominal
+ * voltage, and are scaled up as the battery discharges.
+ */
+void battery_init(uint32_t scale, uint16_t offset);
+/* nominal in mV, 0 disables compensation */
+void battery_set_nominal(uint32_t nominal);
+/* Feed in a new raw ADC sample, once per control tick */
+void battery_update(uint16_t raw);
+/* Filtered battery voltage in mV */
+uint32_t battery_get_mv(void);
+uint16_t battery_compensate(uint16_t duty);
+
+#endif /* __BATTERY_H__ */
@@ -17,21 +17,50 @@
 #include <stdio.h>
 #include <stdbool.h>
 
+#include <libopencm3/cm3/cortex.h>
+
 #include "controller.h"
+#include "fixed.h"
+
+/* Integral gain per tick, and derivative scale */
+#define CONTROLLER_I_SCALE Q15(25.0 / 256)
+#define CONTROLLER_D_SCALE 10
+/* Integral limit, a duty change of 1000 per tick at Ki = 1 */
+#define CONTROLLER_ILIMIT 1000
 
 void controller_init(struct controller *c, const struct gain *gs, uint8_t ngains) {
 	c->skip = 1;
 	c->gains = gs;
 	c->ngains = ngains;
+	c->ilimit = CONTROLLER_ILIMIT;
+	controller_set_strategy(c, CONTROLLER_PID, NULL);
+}
+
+/* Forget any history, the current output is taken to suit the set point */
+static void controller_reset_strategy(struct controller *c)
+{
+	switch (c->strategy) {
+	case CONTROLLER_PI_FF:
+		c->state.ff.last_sp = c->set_point;
+		break;
+	case CONTROLLER_OBSERVER:
+		c->state.obs.valid = false;
+		break;
+	default:
+		break;
+	}
 }
 
 void controller_reset(struct controller *c)
 {
 	c->skip = 1;
-	c->ierr = c->ilimit = c->err = 0;
+	c->ierr = c->err = 0;
+	controller_reset_strategy(c);
 }
 
 void controller_set_gains(struct controller *c, int32_t Kc, int32_t Kd, int32_t Ki) {
+	CM_ATOMIC_CONTEXT();
+
 	if (Kc || Kd || Ki) {
 		c->gain.Kc = Kc;
 		c->gain.Kd = Kd;
@@ -44,6 +73,11 @@ void controller_set_gains(struct controller *c, int32_t Kc, int32_t Kd, int32_t
 
 void controller_set(struct controller *c, uint32_t set_point) {
 	c->set_point = set_point;
+
+	/* Stopped, so the output is 0 */
+	if (!set_point) {
+		controller_reset_strategy(c);
+	}
 }
 
 uint32_t controller_get(struct controller *c) {
@@ -54,44 +88,201 @@ void controller_set_ilimit(struct controller *c, int32_t ilimit) {
 	c->ilimit = ilimit;
 }
 
-int32_t controller_tick(struct controller *c, uint32_t pv, uint8_t gs_idx) {
-	const struct gain *gains;
-	int32_t tc, td, ti, ret;
+/*
+ * If we aren't moving and we're meant to be, nudge up the duty.
+ * It's a horrible hack...
+ */
+static int32_t controller_nudge(struct controller *c)
+{
+	c->tc = c->td = c->ti = 0;
+	//c->skip++;
+	if (c->set_point != 0) {
+		return 1000;
+	}
+	return 0;
+}
+
+static void controller_integrate(struct controller *c, int32_t err)
+{
+	c->ierr += q15_scale(err, CONTROLLER_I_SCALE, Q_ROUND_TRUNC) / c->skip;
+	c->ierr = q_clamp(c->ierr, -c->ilimit, c->ilimit);
+}
+
+static int32_t controller_pid(struct controller *c, uint32_t pv,
+			      const struct gain *gains)
+{
 	int32_t err, derr;
 
-	if (gs_idx >= c->ngains) {
-		return 0;
+	if (pv == 0) {
+		return controller_nudge(c);
 	}
 
-	gains = c->gain_override ? &c->gain : &c->gains[gs_idx];
+	err = c->set_point - pv;
+	controller_integrate(c, err);
+	if (c->pv_rate_valid) {
+		/* Derivative on measurement, no noise or set point kicks */
+		derr = q_sat32((int64_t)-c->pv_rate * CONTROLLER_D_SCALE);
+	} else {
+		derr = q_sat32((int64_t)(err - c->err) * (CONTROLLER_D_SCALE * c->skip));
+	}
+	c->err = err;
+	c->skip = 1;
 
-	/*
-	 * If we aren't moving and we're meant to be, nudge up the duty.
-	 * It's a horrible hack...
-	 */
-	if (pv == 0) {
-		//c->skip++;
-		if (c->set_point != 0) {
-			return 1000;
-		}
+	c->tc = q16_mul(err, gains->Kc);
+	c->td = q16_mul(derr, gains->Kd);
+	c->ti = q16_mul(c->ierr, gains->Ki);
+
+	return q16_add_sat(q16_add_sat(c->tc, c->td), c->ti);
+}
+
+/* Feed-forward duty for a set point, 0 when stopped */
+static int32_t controller_ff_duty(struct controller_ff *ff, uint32_t set_point)
+{
+	if (!set_point)
 		return 0;
+
+	/* q16_recip() of the raw value is 2^32 / set_point */
+	return ((int64_t)ff->kff * (uint32_t)q16_recip(q_sat32(set_point))) >> 32;
+}
+
+/*
+ * The output is a change in duty, so the feed-forward term is the
+ * difference since the last set point. It's traced in place of D.
+ */
+static int32_t controller_pi_ff(struct controller *c, uint32_t pv,
+				const struct gain *gains)
+{
+	struct controller_ff *ff = c->closure;
+	int32_t err, tff;
+
+	/* Feed-forward doesn't need to wait for feedback */
+	tff = controller_ff_duty(ff, c->set_point) -
+	      controller_ff_duty(ff, ff->last_sp);
+	ff->last_sp = c->set_point;
+
+	if (pv == 0) {
+		return q16_add_sat(controller_nudge(c), tff);
 	}
 
 	err = c->set_point - pv;
-	c->ierr += ((err * 25) / (256 * c->skip));
-	if (c->ierr > c->ilimit) {
-		c->ierr = c->ilimit;
-	} else if (c->ierr < -c->ilimit) {
-		c->ierr = -c->ilimit;
-	}
-	derr = (err - c->err) * (10 * c->skip);
+	controller_integrate(c, err);
 	c->err = err;
 	c->skip = 1;
 
-	tc = ((int64_t)(err) * gains->Kc) / 65536;
-	td = ((int64_t)(derr) * gains->Kd) / 65536;
-	ti = ((int64_t)(c->ierr) * gains->Ki) / 65536;
-	ret = tc + td + ti;
+	c->tc = q16_mul(err, gains->Kc);
+	c->ti = q16_mul(c->ierr, ff->ki);
+	c->td = tff;
+
+	return q16_add_sat(q16_add_sat(c->tc, c->td), c->ti);
+}
+
+/*
+ * Velocity-form PI on the speed, which is linear in duty unlike the period,
+ * so it doesn't need a gain schedule. The speed comes from the motor's
+ * observer when there is one, which filters out the quantisation of the
+ * period.
+ */
+static int32_t controller_observer(struct controller *c, uint32_t pv,
+				   const struct gain *gains)
+{
+	struct controller_observer *obs = c->closure;
+	int32_t speed, target, err;
+
+	(void)gains;
+
+	if (pv == 0) {
+		obs->valid = false;
+		return controller_nudge(c);
+	}
+
+	speed = c->pv_speed_valid ? c->pv_speed : q16_recip(q_sat32(pv));
+	target = q16_recip(q_sat32(c->set_point));
+	err = q_sat32((int64_t)target - speed);
+
+	if (!obs->valid) {
+		obs->err = err;
+		obs->valid = true;
+	}
+
+	c->tc = q16_mul(q_sat32((int64_t)err - obs->err), obs->kp);
+	c->ti = q16_mul(err, obs->ki);
+	c->td = 0;
+	c->err = err;
+	obs->err = err;
+
+	return q16_add_sat(c->tc, c->ti);
+}
+
+int controller_set_strategy(struct controller *c, enum controller_strategy strategy,
+			    const int32_t *params)
+{
+	/* The control tick can't run with the state half written */
+	CM_ATOMIC_CONTEXT();
+
+	switch (strategy) {
+	case CONTROLLER_PID:
+		controller_set_process(c, controller_pid, NULL);
+		break;
+	case CONTROLLER_PI_FF:
+		c->state.ff.kff = params ? params[0] : 0;
+		c->state.ff.ki = params ? params[1] : 0;
+		controller_set_process(c, controller_pi_ff, &c->state.ff);
+		break;
+	case CONTROLLER_OBSERVER:
+		c->state.obs.kp = params ? params[0] : 0;
+		c->state.obs.ki = params ? params[1] : 0;
+		controller_set_process(c, controller_observer, &c->state.obs);
+		break;
+	default:
+		return -1;
+	}
+
+	c->strategy = strategy;
+	controller_reset_strategy(c);
+
+	return 0;
+}
+
+void controller_set_process(struct controller *c, controller_process_fn process,
+			    void *closure)
+{
+	CM_ATOMIC_CONTEXT();
+
+	c->strategy = CONTROLLER_CUSTOM;
+	c->closure = closure;
+	c->process = process;
+}
+
+void controller_set_pv_rate(struct controller *c, int32_t rate)
+{
+	c->pv_rate = rate;
+	c->pv_rate_valid = true;
+}
+
+void controller_set_pv_speed(struct controller *c, int32_t speed)
+{
+	c->pv_speed = speed;
+	c->pv_speed_valid = true;
+}
+
+void controller_clear_pv(struct controller *c)
+{
+	c->pv_rate_valid = c->pv_speed_valid = false;
+}
+
+int32_t controller_tick(struct controller *c, uint32_t pv, uint8_t gs_idx) {
+	const struct gain *gains;
+	int32_t ret;
+
+	if (gs_idx >= c->ngains) {
+		controller_clear_pv(c);
+		return 0;
+	}
+
+	gains = c->gain_override ? &c->gain : &c->gains[gs_idx];
+
+	ret = c->process(c, pv, gains);
+	controller_clear_pv(c);
 
 	return ret;
 }
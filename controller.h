@@ -17,14 +17,58 @@
 #ifndef __CONTROLLER_H__
 #define __CONTROLLER_H__
 
+#include <stdbool.h>
 #include <stdint.h>
 
-#define FP_VAL(_x) ((uint32_t)(_x * 65536))
+#include "fixed.h"
 
 struct gain {
-	int32_t Kc;
-	int32_t Kd;
-	int32_t Ki;
+	q16_t Kc;
+	q16_t Kd;
+	q16_t Ki;
+};
+
+struct controller;
+
+/*
+ * A control strategy. Returns the change in duty for this tick. pv is 0
+ * when the motor isn't turning. c->closure is the strategy's own state.
+ */
+typedef int32_t (*controller_process_fn)(struct controller *c, uint32_t pv,
+					 const struct gain *gains);
+
+enum controller_strategy {
+	/* The original, on the period error */
+	CONTROLLER_PID = 0,
+	/*
+	 * PI on the period error, plus feed-forward of duty = Kff / setpoint.
+	 * params[0] is Kff, in duty * period units, and params[1] is Ki,
+	 * Q16.16. Kc comes from the gain schedule.
+	 */
+	CONTROLLER_PI_FF,
+	/*
+	 * PI in speed units (2^32 / period), on the speed from the motor's
+	 * observer (see controller_set_pv_speed()), or the raw pv without
+	 * one. params[0] and params[1] are Kp and Ki, Q16.16.
+	 */
+	CONTROLLER_OBSERVER,
+
+	CONTROLLER_CUSTOM,
+};
+
+#define CONTROLLER_N_PARAMS 2
+
+struct controller_ff {
+	int32_t kff;
+	q16_t ki;
+	uint32_t last_sp;
+};
+
+struct controller_observer {
+	q16_t kp, ki;
+	/* The last error */
+	int32_t err;
+	bool valid;
 };
 
 struct controller {
@@ -39,8 +83,23 @@ struct controller {
 	int32_t err;
 	int skip;
 
-	uint32_t (*process)(void *);
+	/* Rate of change of pv per tick, from an observer, for this tick */
+	int32_t pv_rate;
+	bool pv_rate_valid;
+	/* Speed (2^32 / pv), from an observer, for this tick */
+	int32_t pv_speed;
+	bool pv_speed_valid;
+
+	/* Terms from the last tick, for tracing */
+	int32_t tc, td, ti;
+
+	enum controller_strategy strategy;
+	controller_process_fn process;
 	void *closure;
+	union {
+		struct controller_ff ff;
+		struct controller_observer obs;
+	} state;
 };
 
 void controller_init(struct controller *c, const struct gain *gains, uint8_t ngains);
@@ -50,5 +109,26 @@ void controller_set_ilimit(struct controller *c, int32_t ilimit);
 void controller_set(struct controller *c, uint32_t set_point);
 uint32_t controller_get(struct controller *c);
 int32_t controller_tick(struct controller *c, uint32_t pv, uint8_t gs_idx);
+/*
+ * Provide a (filtered) rate of change of pv for the next tick, which PID
+ * uses for the derivative instead of differencing the error.
+ */
+void controller_set_pv_rate(struct controller *c, int32_t rate);
+/*
+ * Provide a filtered speed, in 2^32 / pv units, for the next tick, which
+ * CONTROLLER_OBSERVER uses instead of the raw pv.
+ */
+void controller_set_pv_speed(struct controller *c, int32_t speed);
+/*
+ * Forget anything from the setters above. Call before providing them, so
+ * a tick which returns early can't leave them to be used later.
+ */
+void controller_clear_pv(struct controller *c);
+/* Returns 0 on success, params can be NULL for the defaults */
+int controller_set_strategy(struct controller *c, enum controller_strategy strategy,
+			    const int32_t *params);
+/* Use some other strategy, closure is passed back in c->closure */
+void controller_set_process(struct controller *c, controller_process_fn process,
+			    void *closure);
 
 #endif /* __CONTROLLER_H__ */
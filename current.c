@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+
+#include "current.h"
+
+/* Duty reduction per mA over the limit, per tick */
+#define CURRENT_LIMIT_GAIN 16
+
+void current_sense_init(struct current_sense *cs, uint32_t scale,
+			uint16_t offset, uint8_t shift)
+{
+	cs->scale = scale;
+	cs->offset = offset;
+	cs->shift = shift;
+	cs->limit = 0;
+	cs->filtered = 0;
+	cs->duty_limit = 0xffff;
+}
+
+void current_sense_set_limit(struct current_sense *cs, uint32_t limit)
+{
+	cs->limit = limit;
+	cs->duty_limit = 0xffff;
+}
+
+uint32_t current_sense_update(struct current_sense *cs, uint16_t raw)
+{
+	uint32_t ma = 0;
+
+	if (raw > cs->offset) {
+		/* Q16.16 */
+		ma = (raw - cs->offset) * cs->scale;
+	}
+
+	/* Exponential moving average */
+	if (ma > cs->filtered) {
+		cs->filtered += (ma - cs->filtered) >> cs->shift;
+	} else {
+		cs->filtered -= (cs->filtered - ma) >> cs->shift;
+	}
+
+	return current_sense_get(cs);
+}
+
+uint32_t current_sense_get(struct current_sense *cs)
+{
+	return cs->filtered >> 16;
+}
+
+uint16_t current_limit_apply(struct current_sense *cs, uint16_t duty)
+{
+	int32_t err, lim;
+
+	if (!cs->limit) {
+		return duty;
+	}
+
+	/* Integrate the error into the duty limit */
+	err = (int32_t)cs->limit - (int32_t)current_sense_get(cs);
+	if (err > 0xffff / CURRENT_LIMIT_GAIN) {
+		err = 0xffff / CURRENT_LIMIT_GAIN;
+	} else if (err < -0xffff / CURRENT_LIMIT_GAIN) {
+		err = -0xffff / CURRENT_LIMIT_GAIN;
+	}
+
+	lim = (int32_t)cs->duty_limit + err * CURRENT_LIMIT_GAIN;
+	if (lim < 0) {
+		lim = 0;
+	} else if (lim > 0xffff) {
+		lim = 0xffff;
+	}
+	cs->duty_limit = lim;
+
+	return duty < cs->duty_limit ? duty : cs->duty_limit;
+}
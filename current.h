@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __CURRENT_H__
+#define __CURRENT_H__
+
+#include <stdint.h>
+
+/*
+ * Motor current filtering and limiting. This has no hardware dependencies,
+ * raw ADC samples are passed in by the caller.
+ */
+struct current_sense {
+	/* Initialise these with current_sense_init() */
+	uint32_t scale;      /* mA per ADC count, Q16.16 */
+	uint16_t offset;     /* ADC counts at zero current */
+	uint8_t shift;       /* Low-pass filter coefficient is 1 / 2^shift */
+
+	/* mA, 0 means no limit */
+	uint32_t limit;
+
+	/* These will be updated dynamically */
+	uint32_t filtered;   /* mA, Q16.16 */
+	uint32_t duty_limit;
+};
+
+void current_sense_init(struct current_sense *cs, uint32_t scale,
+			uint16_t offset, uint8_t shift);
+void current_sense_set_limit(struct current_sense *cs, uint32_t limit);
+/* Feed in a new raw sample, returns the filtered current in mA */
+uint32_t current_sense_update(struct current_sense *cs, uint16_t raw);
+uint32_t current_sense_get(struct current_sense *cs);
+/*
+ * Run one step of the current limit loop, and return duty reduced as
+ * necessary to keep the current below the limit.
+ */
+uint16_t current_limit_apply(struct current_sense *cs, uint16_t duty);
+
+#endif /* __CURRENT_H__ */
@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "drive.h"
+#include "fixed.h"
+#include "log.h"
+#include "motor.h"
+#include "spi.h"
+#include "systick.h"
+
+/* 2 * pi, Q16.16 */
+#define TWO_PI_Q16 411775
+
+/*
+ * Angles are held as binary angles, where 2^32 is one full turn, so they
+ * wrap for free.
+ */
+struct odometry {
+	int64_t x;   /* um, Q16.16 */
+	int64_t y;   /* um, Q16.16 */
+	uint32_t theta;
+
+	int32_t last_left;
+	int32_t last_right;
+};
+
+struct drive {
+	/* Set by DRIVE_CONFIG */
+	uint32_t wheelbase;      /* um */
+	uint32_t wheel_radius;   /* um */
+	uint32_t counts_per_rev;
+
+	/* Derived */
+	int64_t um_per_count;    /* Q16.16 */
+	/* Heading change per count of difference between the wheels */
+	uint32_t angle_per_count;
+
+	struct odometry odom;
+	bool configured;
+	volatile bool reset_odom;
+};
+
+static struct drive drive;
+
+/* sin() of a binary angle, Q16.16 */
+static q16_t drive_sin(uint32_t angle)
+{
+	int32_t a = angle;
+	q16_t x, x2, term, sum;
+
+	/* Reduce to [-pi/2, pi/2] */
+	if (a > (1 << 30)) {
+		a = (int32_t)(0x80000000u - (uint32_t)a);
+	} else if (a < -(1 << 30)) {
+		a = INT32_MIN - a;
+	}
+
+	/* Binary angle to radians */
+	x = ((int64_t)a * TWO_PI_Q16) >> 32;
+	x2 = q16_mul_round(x, x, Q_ROUND_FLOOR);
+
+	/* Taylor series, good to a few LSBs over this range */
+	sum = term = x;
+	term = -q16_mul_round(term, x2, Q_ROUND_FLOOR) / 6;
+	sum += term;
+	term = -q16_mul_round(term, x2, Q_ROUND_FLOOR) / 20;
+	sum += term;
+	term = -q16_mul_round(term, x2, Q_ROUND_FLOOR) / 42;
+	sum += term;
+
+	return sum;
+}
+
+static q16_t drive_cos(uint32_t angle)
+{
+	return drive_sin(angle + (1 << 30));
+}
+
+/* Convert a speed in um/s to counts/s */
+static int32_t drive_um_to_counts(int64_t um)
+{
+	return (um << 16) / drive.um_per_count;
+}
+
+int32_t drive_mm_to_counts(int32_t mm)
+{
+	if (!drive.configured) {
+		return -1;
+	}
+
+	return drive_um_to_counts((int64_t)mm * 1000);
+}
+
+void drive_set(int32_t v, int32_t omega)
+{
+	int64_t v_um = (int64_t)v * 1000;
+	/* omega (mrad/s) * half the wheelbase (um) is the wheel speed in nm/s */
+	int64_t diff = ((int64_t)omega * drive.wheelbase) / 2000;
+
+	if (!drive.configured) {
+		log_warn("Drive not configured\n");
+		return;
+	}
+
+	motor_request_velocity(MOTOR_A, drive_um_to_counts(v_um - diff));
+	motor_request_velocity(MOTOR_B, drive_um_to_counts(v_um + diff));
+}
+
+static void drive_configure(uint32_t wheelbase, uint32_t wheel_radius,
+			    uint32_t counts_per_rev)
+{
+	if (!wheelbase || !wheel_radius || !counts_per_rev) {
+		log_err("Invalid drive config\n");
+		return;
+	}
+
+	drive.configured = false;
+
+	drive.wheelbase = wheelbase;
+	drive.wheel_radius = wheel_radius;
+	drive.counts_per_rev = counts_per_rev;
+	drive.um_per_count = ((int64_t)TWO_PI_Q16 * wheel_radius) / counts_per_rev;
+	/* (um_per_count / wheelbase) radians, as a binary angle */
+	drive.angle_per_count = (drive.um_per_count << 32) /
+				((int64_t)TWO_PI_Q16 * wheelbase);
+	drive.reset_odom = true;
+
+	drive.configured = true;
+}
+
+static void odometry_reset(struct odometry *o)
+{
+	o->x = o->y = 0;
+	o->theta = 0;
+	o->last_left = motor_get_count(MOTOR_A);
+	o->last_right = motor_get_count(MOTOR_B);
+}
+
+static void odometry_send(struct odometry *o)
+{
+	struct odometry_data {
+		uint32_t timestamp;
+		int32_t x;       /* um */
+		int32_t y;       /* um */
+		int32_t theta;   /* radians, Q16.16 */
+	} *d;
+
+	struct spi_pl_packet *pkt = spi_alloc_packet();
+	if (!pkt) {
+		return;
+	}
+
+	pkt->type = EP_DRIVE;
+	d = (struct odometry_data *)pkt->data;
+	d->timestamp = msTicks;
+	d->x = o->x >> 16;
+	d->y = o->y >> 16;
+	d->theta = ((int64_t)(int32_t)o->theta * TWO_PI_Q16) >> 32;
+
+	spi_send_packet(pkt);
+}
+
+static void odometry_tick(struct odometry *o)
+{
+	int32_t left = motor_get_count(MOTOR_A);
+	int32_t right = motor_get_count(MOTOR_B);
+	int32_t cl, cr;
+	int64_t ds;
+	int32_t dtheta;
+	uint32_t heading;
+
+	cl = left - o->last_left;
+	cr = right - o->last_right;
+	o->last_left = left;
+	o->last_right = right;
+
+	ds = ((int64_t)(cl + cr) * drive.um_per_count) / 2;
+	/* Binary angle, so no divisions needed each tick */
+	dtheta = (cr - cl) * drive.angle_per_count;
+
+	/* Integrate along the mid-point heading */
+	heading = o->theta + dtheta / 2;
+	o->x += (ds * drive_cos(heading)) >> 16;
+	o->y += (ds * drive_sin(heading)) >> 16;
+	o->theta += dtheta;
+}
+
+void drive_tick(void)
+{
+	if (!drive.configured) {
+		return;
+	}
+
+	if (drive.reset_odom) {
+		odometry_reset(&drive.odom);
+		drive.reset_odom = false;
+	}
+
+	odometry_tick(&drive.odom);
+	odometry_send(&drive.odom);
+}
+
+enum drive_type {
+	DRIVE_SET = 0,
+	DRIVE_CONFIG = 1,
+	DRIVE_RESET_ODOMETRY = 2,
+};
+
+struct drive_cmd_set {
+	int32_t v;      /* mm/s */
+	int32_t omega;  /* mrad/s, anti-clockwise positive */
+};
+
+struct drive_cmd_config {
+	uint32_t wheelbase;      /* um */
+	uint32_t wheel_radius;   /* um */
+	uint32_t counts_per_rev;
+};
+
+struct drive_cmd {
+	enum drive_type type;
+	union {
+		/* type == DRIVE_SET */
+		struct drive_cmd_set set;
+		/* type == DRIVE_CONFIG */
+		struct drive_cmd_config config;
+	} payloads;
+};
+
+void drive_process_packet(struct spi_pl_packet *pkt)
+{
+	struct drive_cmd *cmd = (struct drive_cmd *)pkt->data;
+
+	if ((pkt->type != EP_DRIVE) || (pkt->flags & SPI_FLAG_ERROR))
+		return;
+
+	if (cmd->type == DRIVE_SET) {
+		drive_set(cmd->payloads.set.v, cmd->payloads.set.omega);
+	} else if (cmd->type == DRIVE_CONFIG) {
+		struct drive_cmd_config *cfg = &cmd->payloads.config;
+		drive_configure(cfg->wheelbase, cfg->wheel_radius, cfg->counts_per_rev);
+	} else if (cmd->type == DRIVE_RESET_ODOMETRY) {
+		drive.reset_odom = true;
+	}
+}
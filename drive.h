@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __DRIVE_H__
+#define __DRIVE_H__
+
+#include <stdint.h>
+
+#include "spi.h"
+
+/*
+ * Differential drive kinematics and odometry.
+ * MOTOR_A is the left wheel, MOTOR_B is the right wheel. Odometry
+ * telemetry is sent with the same packet type as the endpoint.
+ */
+#define EP_DRIVE 20
+
+void drive_process_packet(struct spi_pl_packet *pkt);
+/* Set linear (mm/s) and angular (mrad/s, anti-clockwise positive) velocity */
+void drive_set(int32_t v, int32_t omega);
+/*
+ * Convert a distance (or speed) in mm to wheel counts (or counts/s).
+ * Returns -1 if the drive isn't configured.
+ */
+int32_t drive_mm_to_counts(int32_t mm);
+/* Call once per control tick, after the motors have been updated */
+void drive_tick(void);
+
+#endif /* __DRIVE_H__ */
@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/timer.h>
+
+#include "encoder.h"
+
+void encoder_init(struct encoder *enc)
+{
+	uint32_t timer = enc->timer;
+
+	gpio_set_mode(enc->port, GPIO_MODE_INPUT,
+		      GPIO_CNF_INPUT_FLOAT, enc->pins);
+
+	timer_reset(timer);
+	timer_set_period(timer, 0xffff);
+	timer_set_prescaler(timer, 0);
+
+	/* Count on both edges of both inputs */
+	timer_slave_set_mode(timer, TIM_SMCR_SMS_EM3);
+	timer_ic_set_input(timer, TIM_IC1, TIM_IC_IN_TI1);
+	timer_ic_set_input(timer, TIM_IC2, TIM_IC_IN_TI2);
+	timer_ic_set_filter(timer, TIM_IC1, TIM_IC_DTF_DIV_2_N_6);
+	timer_ic_set_filter(timer, TIM_IC2, TIM_IC_DTF_DIV_2_N_6);
+
+	/* Capture the count on input 1's rising edges, to time them */
+	seqlock_init(&enc->lock);
+	timer_ic_enable(timer, TIM_IC1);
+	timer_enable_irq(timer, TIM_DIER_CC1IE);
+	nvic_enable_irq(enc->irq);
+
+	timer_enable_counter(timer);
+
+	encoder_reset(enc);
+}
+
+void encoder_reset(struct encoder *enc)
+{
+	enc->last = timer_get_counter(enc->timer);
+	enc->position = 0;
+	enc->ref_valid = false;
+	enc->estimate = 0;
+}
+
+int32_t encoder_update(struct encoder *enc)
+{
+	uint16_t cnt = timer_get_counter(enc->timer);
+	/* Wrapping 16-bit subtraction gives the signed distance moved */
+	int16_t delta = (int16_t)(cnt - enc->last);
+
+	enc->last = cnt;
+	enc->position += delta;
+
+	return delta;
+}
+
+int64_t encoder_get_position(struct encoder *enc)
+{
+	return enc->position;
+}
+
+void encoder_capture(struct encoder *enc)
+{
+	uint32_t now = dwt_read_cycle_counter();
+
+	if (!timer_get_flag(enc->timer, TIM_SR_CC1IF))
+		return;
+
+	seqlock_write_begin(&enc->lock);
+	/* Reading the capture clears the flag */
+	enc->edge_cnt = TIM_CCR1(enc->timer);
+	enc->edge_time = now;
+	enc->edge = true;
+	seqlock_write_end(&enc->lock);
+}
+
+int32_t encoder_estimate(struct encoder *enc)
+{
+	uint32_t seq, time, now, elapsed;
+	int64_t position, counts;
+	uint16_t cnt;
+	bool edge;
+
+	do {
+		seq = seqlock_read_begin(&enc->lock);
+		edge = enc->edge;
+		cnt = enc->edge_cnt;
+		time = enc->edge_time;
+		now = dwt_read_cycle_counter();
+	} while (seqlock_read_retry(&enc->lock, seq));
+
+	if (edge && time != enc->ref_time) {
+		/* The edge was within 32767 counts of the last update */
+		position = enc->position - (int16_t)(enc->last - cnt);
+		counts = position - enc->ref_position;
+
+		if (enc->ref_valid) {
+			elapsed = time - enc->ref_time;
+			/* Back and forth over the same edge is as good as stopped */
+			elapsed = counts ? elapsed / llabs(counts) : 0;
+			if (elapsed > INT32_MAX)
+				elapsed = INT32_MAX;
+			enc->estimate = counts < 0 ? -(int32_t)elapsed : (int32_t)elapsed;
+		}
+
+		enc->ref_position = position;
+		enc->ref_time = time;
+		enc->ref_valid = true;
+
+		return enc->estimate;
+	}
+
+	if (!enc->ref_valid)
+		return 0;
+
+	/* The cycle counter wraps, so give up on a wheel that long stopped */
+	elapsed = now - enc->ref_time;
+	if (elapsed > INT32_MAX) {
+		enc->ref_valid = false;
+		enc->estimate = 0;
+	}
+
+	if (!enc->estimate)
+		return 0;
+
+	/* No edges: the next is at least a whole cycle on from the last */
+	elapsed /= ENCODER_COUNTS_PER_EDGE;
+	if (elapsed > (uint32_t)abs(enc->estimate))
+		return enc->estimate < 0 ? -(int32_t)elapsed : (int32_t)elapsed;
+
+	return enc->estimate;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __ENCODER_H__
+#define __ENCODER_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "seqlock.h"
+
+/* Quadrature counts per rising edge on a single encoder channel */
+#define ENCODER_COUNTS_PER_EDGE 4
+
+/*
+ * Quadrature encoder using a timer's hardware encoder interface. The timer
+ * counts up and down by itself, so there are no per-edge interrupts. The
+ * 16-bit hardware counter is extended to 64-bits by encoder_update(), which
+ * must be called often enough that the counter can't move by more than
+ * 32767 counts between calls.
+ *
+ * Rising edges on input 1 also capture the counter, and interrupt so that
+ * encoder_capture() can note the CPU cycle counter with it. That times the
+ * motion much more finely than counting over a control tick does.
+ */
+struct encoder {
+	/* Initialise these */
+	uint32_t timer;
+	/* The capture interrupt */
+	uint8_t irq;
+	uint32_t port;
+	uint16_t pins;
+
+	/* These will be updated dynamically */
+	uint16_t last;
+	int64_t position;
+
+	/* The counter and cycle counter at the newest edge, and the lock for them */
+	struct seqlock lock;
+	uint16_t edge_cnt;
+	uint32_t edge_time;
+	bool edge;
+
+	/* M/T estimator state, the position and time of the last edge used */
+	int64_t ref_position;
+	uint32_t ref_time;
+	bool ref_valid;
+	int32_t estimate;
+};
+
+void encoder_init(struct encoder *enc);
+void encoder_reset(struct encoder *enc);
+/* Returns the (signed) number of counts moved since the last call */
+int32_t encoder_update(struct encoder *enc);
+int64_t encoder_get_position(struct encoder *enc);
+/* Call from the timer's capture interrupt */
+void encoder_capture(struct encoder *enc);
+/*
+ * Signed speed in CPU cycles per count, negative going backwards. It's the
+ * time between the newest edges seen by this call and the last one, over
+ * the counts between them. If there's no new edge it's at least the time
+ * since the last one. Call after encoder_update(). 0 if it's stopped, or
+ * not known yet.
+ */
+int32_t encoder_estimate(struct encoder *enc);
+
+#endif /* __ENCODER_H__ */
@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __FIXED_H__
+#define __FIXED_H__
+
+#include <stdint.h>
+
+/*
+ * Fixed-point helpers.
+ *
+ * q16_t is Q16.16, q15_t is Q1.15 (for values in [-1, 1)). The
+ * multiplies only care about the fractional bits of the second argument,
+ * so q16_mul() also scales a plain integer by a Q16.16 gain.
+ * Everything saturates rather than wrapping.
+ */
+typedef int32_t q16_t;
+typedef int16_t q15_t;
+
+#define Q16_ONE (1 << 16)
+#define Q15_ONE (1 << 15)
+
+#define Q16_MAX INT32_MAX
+#define Q16_MIN INT32_MIN
+#define Q15_MAX INT16_MAX
+#define Q15_MIN INT16_MIN
+
+/* Constant conversions, rounded to nearest. Q15(1.0) is out of range. */
+#define Q16(_x) ((q16_t)((_x) * 65536.0 + ((_x) < 0 ? -0.5 : 0.5)))
+#define Q15(_x) ((q15_t)((_x) * 32768.0 + ((_x) < 0 ? -0.5 : 0.5)))
+
+enum q_round {
+	/* Towards zero, like integer division */
+	Q_ROUND_TRUNC = 0,
+	/* Towards -infinity, like an arithmetic shift */
+	Q_ROUND_FLOOR,
+	/* Half away from zero */
+	Q_ROUND_NEAREST,
+};
+
+static inline int32_t q_sat32(int64_t v)
+{
+	if (v > INT32_MAX)
+		return INT32_MAX;
+	else if (v < INT32_MIN)
+		return INT32_MIN;
+	return v;
+}
+
+static inline int16_t q_sat16(int32_t v)
+{
+	if (v > INT16_MAX)
+		return INT16_MAX;
+	else if (v < INT16_MIN)
+		return INT16_MIN;
+	return v;
+}
+
+static inline int32_t q_clamp(int32_t v, int32_t min, int32_t max)
+{
+	if (v > max)
+		return max;
+	else if (v < min)
+		return min;
+	return v;
+}
+
+/* Shift v right by shift bits (> 0), rounding as requested */
+static inline int64_t q_shift(int64_t v, unsigned int shift, enum q_round round)
+{
+	switch (round) {
+	case Q_ROUND_FLOOR:
+		return v >> shift;
+	case Q_ROUND_NEAREST:
+		if (v < 0)
+			return -((-v + ((int64_t)1 << (shift - 1))) >> shift);
+		return (v + ((int64_t)1 << (shift - 1))) >> shift;
+	case Q_ROUND_TRUNC:
+	default:
+		if (v < 0)
+			return -(-v >> shift);
+		return v >> shift;
+	}
+}
+
+static inline q16_t q16_from_int(int32_t v)
+{
+	return q_sat32((int64_t)v << 16);
+}
+
+static inline int32_t q16_to_int(q16_t a, enum q_round round)
+{
+	return q_shift(a, 16, round);
+}
+
+static inline q16_t q16_add_sat(q16_t a, q16_t b)
+{
+	return q_sat32((int64_t)a + b);
+}
+
+static inline q16_t q16_sub_sat(q16_t a, q16_t b)
+{
+	return q_sat32((int64_t)a - b);
+}
+
+static inline q16_t q16_mul_round(q16_t a, q16_t b, enum q_round round)
+{
+	return q_sat32(q_shift((int64_t)a * b, 16, round));
+}
+
+/* Truncates, so int * gain matches the old (a * b) / 65536 */
+static inline q16_t q16_mul(q16_t a, q16_t b)
+{
+	return q16_mul_round(a, b, Q_ROUND_TRUNC);
+}
+
+static inline q16_t q16_div(q16_t a, q16_t b)
+{
+	if (!b)
+		return a < 0 ? Q16_MIN : Q16_MAX;
+	return q_sat32(((int64_t)a << 16) / b);
+}
+
+/*
+ * 1 / a, without a division. Normalises a to [0.5, 1) then does three
+ * Newton-Raphson steps from a linear estimate, which is good to the
+ * last bit or so of the 32-bit intermediate.
+ */
+static inline q16_t q16_recip(q16_t a)
+{
+	uint32_t d, r, e;
+	int n, i;
+	uint64_t res;
+	int neg = a < 0;
+
+	if (!a)
+		return Q16_MAX;
+
+	d = neg ? -(uint32_t)a : (uint32_t)a;
+	n = __builtin_clz(d);
+	d <<= n;
+
+	/* r is Q2.30, d is Q0.32. r0 = 48/17 - 32/17 * d */
+	r = 3031741621u - (uint32_t)(((uint64_t)2021161081u * d) >> 32);
+	for (i = 0; i < 3; i++) {
+		e = ((uint64_t)d * r) >> 32;
+		r = ((uint64_t)r * (0x80000000u - e)) >> 30;
+	}
+
+	/* 1 / a = r * 2^(n - 30) in Q16.16 */
+	if (n > 30) {
+		res = (uint64_t)r << (n - 30);
+	} else {
+		res = ((uint64_t)r + ((1ull << (30 - n)) >> 1)) >> (30 - n);
+	}
+
+	if (res > Q16_MAX)
+		return neg ? Q16_MIN : Q16_MAX;
+
+	return neg ? -(q16_t)res : (q16_t)res;
+}
+
+static inline q15_t q15_add_sat(q15_t a, q15_t b)
+{
+	return q_sat16((int32_t)a + b);
+}
+
+static inline q15_t q15_mul(q15_t a, q15_t b)
+{
+	return q_sat16(q_shift((int32_t)a * b, 15, Q_ROUND_NEAREST));
+}
+
+/* Scale v by a Q1.15 factor */
+static inline int32_t q15_scale(int32_t v, q15_t k, enum q_round round)
+{
+	return q_shift((int64_t)v * k, 15, round);
+}
+
+static inline q16_t q15_to_q16(q15_t a)
+{
+	return (q16_t)a << 1;
+}
+
+static inline q15_t q16_to_q15(q16_t a)
+{
+	return q_sat16(q_shift(a, 1, Q_ROUND_NEAREST));
+}
+
+#endif /* __FIXED_H__ */
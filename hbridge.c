@@ -14,90 +14,256 @@
  * You should have received a copy of the GNU Lesser General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <libopencm3/stm32/gpio.h>
+
 #include "hbridge.h"
 #include "pwm.h"
 
+#define HBRIDGE_DEFAULT_FREQ 15000
+
 static void channel_init_pwm(uint32_t timer, struct channel *c)
 {
-	pwm_channel_disable(timer, c->ch2);
+	/* Both inputs are always driven, decay depends on the idle one */
 	pwm_channel_set_duty(timer, c->ch2, 0);
+	pwm_channel_enable(timer, c->ch2);
 
-	pwm_channel_disable(timer, c->ch1);
 	pwm_channel_set_duty(timer, c->ch1, 0);
+	pwm_channel_enable(timer, c->ch1);
 
 	c->dir = DIRECTION_NONE;
 	c->duty = 0;
+	c->decay = HBRIDGE_DECAY_FAST;
+	c->shifted = false;
+}
+
+static void hbridge_apply_freq(struct hbridge *hb)
+{
+	if (hb->hires) {
+		hb->resolution = pwm_timer_set_freq_hires(hb->timer, hb->freq);
+	} else {
+		hb->resolution = pwm_timer_set_freq(hb->timer, hb->freq);
+	}
 }
 
 void hbridge_init(struct hbridge *hb)
 {
-	pwm_timer_init(hb->timer, 15000);
+	unsigned int i;
+
+	hb->freq = HBRIDGE_DEFAULT_FREQ;
+	hb->hires = false;
+	hb->centre_aligned = false;
+	hb->staging = false;
+	hb->nstaged = 0;
+
+	gpio_set_mode(hb->port, GPIO_MODE_OUTPUT_50_MHZ,
+		      GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, hb->pins);
+
+	pwm_timer_init(hb->timer, hb->freq);
+	hbridge_apply_freq(hb);
 	pwm_timer_enable(hb->timer);
 
-	channel_init_pwm(hb->timer, &hb->a);
-	channel_init_pwm(hb->timer, &hb->b);
+	for (i = 0; i < hb->nchannels; i++) {
+		channel_init_pwm(hb->timer, &hb->channels[i]);
+	}
+}
+
+/* Replaces any value already staged for the same output */
+static void hbridge_stage(struct hbridge *hb, uint32_t ch, uint16_t value)
+{
+	unsigned int i;
+
+	for (i = 0; i < hb->nstaged; i++) {
+		if (hb->staged_ch[i] == ch) {
+			break;
+		}
+	}
+
+	if (i == hb->nstaged) {
+		hb->nstaged++;
+	}
+	hb->staged_ch[i] = ch;
+	hb->staged_val[i] = value;
 }
 
-static void channel_refresh(uint32_t timer, struct channel *c)
+static void channel_write(struct hbridge *hb, struct channel *c, uint32_t ch,
+			  uint16_t duty)
 {
+	uint16_t value = pwm_duty_to_compare(hb->timer, duty, c->shifted);
+
+	if (hb->staging) {
+		hbridge_stage(hb, ch, value);
+		return;
+	}
+
+	pwm_timer_write_compare(hb->timer, &ch, &value, 1);
+}
+
+static void channel_refresh(struct hbridge *hb, struct channel *c)
+{
+	uint16_t drive, idle;
+
+	if (c->decay == HBRIDGE_BRAKE) {
+		drive = PWM_DUTY_FULL;
+		idle = PWM_DUTY_FULL;
+	} else if (c->decay == HBRIDGE_DECAY_SLOW) {
+		/* Hold the drive side high, and PWM the idle side inverted */
+		drive = PWM_DUTY_FULL;
+		idle = PWM_DUTY_FULL - c->duty;
+	} else {
+		drive = c->duty;
+		idle = 0;
+	}
+
 	if (c->dir) {
-		pwm_channel_set_duty(timer, c->ch2, c->duty);
+		channel_write(hb, c, c->ch1, idle);
+		channel_write(hb, c, c->ch2, drive);
 	} else {
-		pwm_channel_set_duty(timer, c->ch1, c->duty);
+		channel_write(hb, c, c->ch2, idle);
+		channel_write(hb, c, c->ch1, drive);
 	}
 }
 
-void hbridge_set_freq(struct hbridge *hb, uint32_t frequency)
+static void channel_set_shifted(struct hbridge *hb, struct channel *c,
+				bool shifted)
 {
-	pwm_timer_disable(hb->timer);
-	pwm_timer_set_freq(hb->timer, frequency);
+	pwm_channel_set_shifted(hb->timer, c->ch1, shifted);
+	pwm_channel_set_shifted(hb->timer, c->ch2, shifted);
+	c->shifted = shifted;
 
-	channel_refresh(hb->timer, &hb->a);
-	channel_refresh(hb->timer, &hb->b);
+	/* Zero is a different compare value in each mode */
+	channel_write(hb, c, c->ch1, 0);
+	channel_write(hb, c, c->ch2, 0);
+}
+
+static void hbridge_refresh(struct hbridge *hb)
+{
+	unsigned int i;
+
+	for (i = 0; i < hb->nchannels; i++) {
+		channel_refresh(hb, &hb->channels[i]);
+	}
+}
+
+uint32_t hbridge_set_freq(struct hbridge *hb, uint32_t frequency, bool hires)
+{
+	pwm_timer_disable(hb->timer);
+	hb->freq = frequency;
+	hb->hires = hires;
+	hbridge_apply_freq(hb);
+	hbridge_refresh(hb);
 
+	/* Don't run out the old period, which might be much longer */
+	pwm_timer_reload(hb->timer);
 	pwm_timer_enable(hb->timer);
+
+	return hb->resolution;
 }
 
-static void channel_set_direction(uint32_t timer, struct channel *c,
-				  enum direction dir)
+void hbridge_set_centre_aligned(struct hbridge *hb, bool centre)
 {
-	if (dir == c->dir) {
-		return;
-	}
+	unsigned int i;
 
-	if (dir) {
-		pwm_channel_set_duty(timer, c->ch1, 0);
-		pwm_channel_disable(timer, c->ch1);
-		pwm_channel_set_duty(timer, c->ch2, 0);
-		pwm_channel_enable(timer, c->ch2);
-	} else {
-		pwm_channel_set_duty(timer, c->ch2, 0);
-		pwm_channel_disable(timer, c->ch2);
-		pwm_channel_set_duty(timer, c->ch1, 0);
-		pwm_channel_enable(timer, c->ch1);
+	pwm_timer_disable(hb->timer);
+	pwm_timer_set_centre_aligned(hb->timer, centre);
+	hbridge_apply_freq(hb);
+	hb->centre_aligned = centre;
+
+	/* Odd channels are interleaved with the even ones */
+	for (i = 1; i < hb->nchannels; i += 2) {
+		channel_set_shifted(hb, &hb->channels[i], centre);
 	}
+	hbridge_refresh(hb);
 
-	c->dir = dir;
+	pwm_timer_reload(hb->timer);
+	pwm_timer_enable(hb->timer);
 }
 
-static void channel_set_duty(uint32_t timer, struct channel *c, uint16_t duty)
+void hbridge_begin_update(struct hbridge *hb)
+{
+	hb->nstaged = 0;
+	hb->staging = true;
+}
+
+void hbridge_commit_update(struct hbridge *hb)
+{
+	hb->staging = false;
+	pwm_timer_write_compare(hb->timer, hb->staged_ch, hb->staged_val,
+				hb->nstaged);
+	hb->nstaged = 0;
+}
+
+static struct channel *get_channel(struct hbridge *hb,
+				   enum hbridge_channel chan)
+{
+	return &hb->channels[chan];
+}
+
+void hbridge_set_duty(struct hbridge *hb, enum hbridge_channel chan,
+		      enum direction dir, uint16_t duty)
 {
+	struct channel *c = get_channel(hb, chan);
+
 	if (duty > 64224) {
 		duty = 64224; /* 98% max duty */
 	}
 
+	c->dir = dir;
 	c->duty = duty;
-	channel_refresh(timer, c);
+	channel_refresh(hb, c);
 }
 
-void hbridge_set_duty(struct hbridge *hb, enum hbridge_channel chan,
-		      enum direction dir, uint16_t duty)
+uint16_t hbridge_get_sample_point(struct hbridge *hb)
 {
-	if (chan == HBRIDGE_A) {
-		channel_set_direction(hb->timer, &hb->a, dir);
-		channel_set_duty(hb->timer, &hb->a, duty);
-	} else {
-		channel_set_direction(hb->timer, &hb->b, dir);
-		channel_set_duty(hb->timer, &hb->b, duty);
+	uint32_t period = pwm_duty_to_count(hb->timer, PWM_DUTY_FULL);
+	uint32_t start = 0, end = period;
+	uint32_t first_start = 0, first_end = period;
+	bool found = false;
+	unsigned int i;
+
+	for (i = 0; i < hb->nchannels; i++) {
+		struct channel *c = &hb->channels[i];
+		uint32_t len, s, e;
+
+		if (c->dir == DIRECTION_NONE || !c->duty ||
+		    c->decay == HBRIDGE_BRAKE)
+			continue;
+
+		/* Fast decay drives at the start of the period, slow at the end */
+		len = pwm_duty_to_count(hb->timer, c->duty);
+		if (c->decay == HBRIDGE_DECAY_SLOW) {
+			s = period - len;
+			e = period;
+		} else {
+			s = 0;
+			e = len;
+		}
+
+		if (!found) {
+			first_start = s;
+			first_end = e;
+			found = true;
+		}
+		start = s > start ? s : start;
+		end = e < end ? e : end;
 	}
+
+	if (start >= end) {
+		start = first_start;
+		end = first_end;
+	}
+
+	return (start + end) / 2;
+}
+
+void hbridge_set_decay(struct hbridge *hb, enum hbridge_channel chan,
+		       enum hbridge_decay decay)
+{
+	struct channel *c = get_channel(hb, chan);
+
+	if (decay == c->decay) {
+		return;
+	}
+
+	c->decay = decay;
+	channel_refresh(hb, c);
 }
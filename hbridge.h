@@ -21,6 +21,9 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+/* One timer has four outputs, so drives two H-bridge channels */
+#define HBRIDGE_MAX_CHANNELS 2
+
 enum hbridge_channel {
 	HBRIDGE_A = 0,
 	HBRIDGE_B,
@@ -33,6 +36,16 @@ enum direction {
 	DIRECTION_NONE = -1,
 };
 
+/* What the bridge does in the PWM off-time */
+enum hbridge_decay {
+	/* Both low-side off, the motor coasts */
+	HBRIDGE_DECAY_FAST = 0,
+	/* Both low side on, the motor brakes. Speed is more linear with duty */
+	HBRIDGE_DECAY_SLOW,
+	/* Brake continuously, ignoring duty */
+	HBRIDGE_BRAKE,
+};
+
 struct channel {
 	/* Initisalise these */
 	uint32_t ch1, ch2;
@@ -40,19 +53,63 @@ struct channel {
 	/* These will be updated dynamically */
 	enum direction dir;
 	uint16_t duty;
+	enum hbridge_decay decay;
+	bool shifted;
 };
 
 struct hbridge {
+	/* Initialise these */
 	uint32_t timer;
-	uint32_t counter;
-	struct channel a;
-	struct channel b;
+	uint32_t port;
+	uint16_t pins;
+	unsigned int nchannels;
+	struct channel channels[HBRIDGE_MAX_CHANNELS];
+
+	uint32_t freq;
+	bool hires;
+	bool centre_aligned;
+	/* Duty steps per PWM period */
+	uint32_t resolution;
+
+	/* Compare values held back by hbridge_begin_update() */
+	bool staging;
+	unsigned int nstaged;
+	uint32_t staged_ch[2 * HBRIDGE_MAX_CHANNELS];
+	uint16_t staged_val[2 * HBRIDGE_MAX_CHANNELS];
 };
 
 void hbridge_init(struct hbridge *hb);
 
-void hbridge_set_freq(struct hbridge *hb, uint32_t freq);
+/*
+ * Returns the resulting resolution, in duty steps. hires trades a lower
+ * minimum frequency for double the resolution.
+ */
+uint32_t hbridge_set_freq(struct hbridge *hb, uint32_t freq, bool hires);
+
+/*
+ * Centre-aligned PWM, with channel B's pulses interleaved between channel
+ * A's to reduce the peak supply current.
+ */
+void hbridge_set_centre_aligned(struct hbridge *hb, bool centre);
+
+/*
+ * Duty, direction and decay changes made between these take effect
+ * together, in the same PWM period. They're held back until the commit,
+ * which writes them all at once.
+ */
+void hbridge_begin_update(struct hbridge *hb);
+void hbridge_commit_update(struct hbridge *hb);
 
 void hbridge_set_duty(struct hbridge *hb, enum hbridge_channel chan,
 		      enum direction dir, uint16_t duty);
+void hbridge_set_decay(struct hbridge *hb, enum hbridge_channel chan,
+		       enum hbridge_decay decay);
+
+/*
+ * Timer count in the middle of the part of an edge-aligned period where
+ * all of the running channels are driving, rather than recirculating, for
+ * sampling the motor current. If they don't overlap, the middle of the
+ * first one's.
+ */
+uint16_t hbridge_get_sample_point(struct hbridge *hb);
 #endif /* __HBRIDGE__ */
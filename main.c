@@ -10,11 +10,17 @@
 #include <string.h>
 #include <stdarg.h>
 
+#include "drive.h"
 #include "hbridge.h"
 #include "log.h"
 #include "motor.h"
 #include "pwm.h"
+#include "rangefinder.h"
+#include "reflex.h"
+#include "schedule.h"
 #include "spi.h"
+#include "trace.h"
+#include "trajectory.h"
 #include "usb_cdc.h"
 
 #include "systick.h"
@@ -29,6 +35,7 @@ static void setup_irq_priorities(void)
 	} map[] = {
 		{ NVIC_EXTI4_IRQ,           (0 << 6) | (0 << 4) },
 		{ NVIC_TIM4_IRQ,            (1 << 6) | (0 << 4) },
+		{ NVIC_TIM1_CC_IRQ,         (1 << 6) | (0 << 4) },
 		{ NVIC_USB_LP_CAN_RX0_IRQ,  (2 << 6) | (0 << 4) },
 		{ NVIC_USB_WAKEUP_IRQ,      (2 << 6) | (1 << 4) },
 		{ NVIC_TIM3_IRQ,            (3 << 6) | (0 << 4) },
@@ -108,12 +115,33 @@ static void gpio_set_process_packet(struct spi_pl_packet *pkt)
 
 #define EP_MOTORS 18
 
+/* Called from the control tick for commands sent via EP_SCHEDULE */
+static void scheduled_process_packet(struct spi_pl_packet *pkt)
+{
+	switch (pkt->type) {
+		case EP_MOTORS:
+			motor_process_packet(pkt);
+			break;
+		case EP_GPIO:
+			gpio_set_process_packet(pkt);
+			break;
+		case EP_DRIVE:
+			drive_process_packet(pkt);
+			break;
+		default:
+			log_warn("Can't schedule type %d\n", (uint32_t)pkt->type);
+	}
+}
+
 int main(void)
 {
+	unsigned int i;
+
 	rcc_clock_setup_in_hse_8mhz_out_72mhz();
 	rcc_periph_clock_enable(RCC_GPIOC);
 	rcc_periph_clock_enable(RCC_GPIOA);
 	rcc_periph_clock_enable(RCC_GPIOB);
+	rcc_periph_clock_enable(RCC_TIM1);
 	rcc_periph_clock_enable(RCC_TIM2);
 	rcc_periph_clock_enable(RCC_TIM3);
 	rcc_periph_clock_enable(RCC_TIM4);
@@ -135,13 +163,19 @@ int main(void)
 
 	gpio_set(GPIOC, GPIO13);
 
+	schedule_init(scheduled_process_packet);
+	trace_init();
 	motor_init();
 	motor_enable_loop();
-	motor_set_speed(HBRIDGE_A, DIRECTION_FWD, 0);
-	motor_set_speed(HBRIDGE_B, DIRECTION_FWD, 0);
+	for (i = 0; i < MOTOR_N; i++) {
+		motor_set_speed(i, DIRECTION_FWD, 0);
+	}
 
 	setup_irq_priorities();
 
+	/* Carry on without them, the host can still send REFLEX_RANGE */
+	rangefinder_init();
+
 	struct spi_pl_packet *pkt;
 	uint32_t time = msTicks;
 	while (1) {
@@ -168,6 +202,32 @@ int main(void)
 					gpio_set_process_packet(pkt);
 					spi_free_packet(pkt);
 					break;
+				case EP_DRIVE:
+					drive_process_packet(pkt);
+					spi_free_packet(pkt);
+					break;
+				case EP_SCHEDULE:
+					if (!schedule_process_packet(pkt)) {
+						spi_free_packet(pkt);
+					}
+					break;
+				case EP_PWM:
+					motor_pwm_process_packet(pkt);
+					spi_send_packet(pkt);
+					break;
+				case EP_REFLEX:
+					reflex_process_packet(pkt);
+					spi_send_packet(pkt);
+					break;
+				case EP_TRACE:
+					trace_process_packet(pkt);
+					spi_send_packet(pkt);
+					break;
+				case EP_TRAJECTORY:
+					trajectory_process_packet(pkt);
+					/* Bounce it back with the status */
+					spi_send_packet(pkt);
+					break;
 				case 0xfe:
 					ep0xfe_process_packet(pkt);
 					spi_free_packet(pkt);
@@ -178,6 +238,8 @@ int main(void)
 			}
 		}
 
+		rangefinder_poll();
+
 		if (msTicks - time >= 100) {
 			time = msTicks;
 			// Do something periodically...
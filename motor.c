@@ -15,7 +15,10 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/timer.h>
+#include <libopencm3/cm3/dwt.h>
 #include <libopencm3/cm3/nvic.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,24 +27,126 @@
 #include "hbridge.h"
 #include "spi.h"
 #include "period_counter.h"
+#include "encoder.h"
 #include "controller.h"
+#include "adc.h"
+#include "current.h"
+#include "battery.h"
+#include "stall.h"
+#include "observer.h"
+#include "profile.h"
+#include "ramp.h"
+#include "reflex.h"
+#include "seqlock.h"
+#include "drive.h"
+#include "schedule.h"
+#include "trajectory.h"
+#include "trace.h"
 
+#include "log.h"
 #include "systick.h"
 
+enum motor_mode {
+	MOTOR_MODE_SPEED = 0,
+	MOTOR_MODE_POSITION,
+};
+
+enum motor_decay {
+	MOTOR_DECAY_FAST = 0,
+	MOTOR_DECAY_SLOW,
+	/* Fast decay when driving, slow decay when slowing down */
+	MOTOR_DECAY_AUTO,
+};
+
+/* How a motor is wired up */
+struct motor_config {
+	struct hbridge *hb;
+	enum hbridge_channel hb_channel;
+#ifdef QUADRATURE_ENCODER
+	struct encoder *enc;
+#else
+	struct period_counter *pc;
+	enum pc_channel pc_channel;
+#endif
+	/* Current sense input, ADC_N_INPUTS for none */
+	enum adc_input adc_input;
+	/* The motor is wired backwards */
+	bool invert;
+};
+
 struct motor {
+	const struct motor_config *cfg;
 	struct controller controller;
+	struct profile profile;
+	struct ramp ramp;
+	struct current_sense current;
+	struct stall stall;
+	struct observer obs;
+	volatile enum motor_mode mode;
 	uint32_t duty;
+	uint16_t output;
 	uint32_t period;
 	uint32_t count;
 	uint32_t setpoint;
-	enum hbridge_channel channel;
-	enum pc_channel pc_channel;
+	enum motor_id id;
 	enum direction dir;
-	uint8_t enabling;
+	/* Turning against dir, which only an encoder can tell */
+	bool backwards;
+	uint8_t gs_idx;
+	enum motor_decay decay;
+	/* Brake instead of coasting when the setpoint is 0 */
+	bool stop_brake;
+
+	/* Actively braking, before reversing to new_dir */
+	bool reversing;
+	enum direction new_dir;
+	uint8_t reverse_ticks;
+	uint32_t reverse_duty;
+
+	/* Velocity trim from motor_sync, Q16.16 counts per tick */
+	q16_t trim;
+	/* Setpoint scale from the forward limit, Q16.16 */
+	q16_t limit_scale;
+
+	/* CPU cycles the last controller_tick() took, from the DWT */
+	uint32_t tick_cycles;
 
-	int changing_direction :1;
+#ifndef QUADRATURE_ENCODER
+	/* Period counter total at the last feedback update */
+	uint32_t pc_total;
+	bool feedback;
+#endif
+
+	/* Published at the end of each tick, for other contexts to read */
+	struct seqlock lock;
+	struct motor_state state;
 };
 
+/*
+ * Cross-coupling between a pair of motors. The difference in how far they
+ * have each travelled, relative to their commanded velocities, is
+ * integrated and fed back as a velocity trim which slows the one that is
+ * ahead and speeds up the other. Pairs are motors (0, 1), (2, 3) etc.
+ */
+struct motor_sync {
+	/* Trim (counts per tick) per count of error, Q16.16. 0 disables */
+	q16_t gain;
+
+	/* Integrated error, Q16.16 counts */
+	int32_t err;
+	uint32_t last_a, last_b;
+	bool valid;
+};
+
+#define MOTOR_N_SYNCS (MOTOR_N / 2)
+static struct motor_sync syncs[MOTOR_N_SYNCS];
+
+/* Limit on the integrated error, counts */
+#define MOTOR_SYNC_LIMIT 200
+
+/* Forward velocity limit, Q16.16 counts per tick. -1 for none */
+static volatile int32_t forward_limit = -1;
+
 struct motor_data {
 	uint32_t timestamp;
 	uint8_t channel;
@@ -49,37 +154,46 @@ struct motor_data {
 	uint16_t duty;
 	uint32_t period;
 	int32_t count;
+	uint16_t current;
+	uint16_t battery;
+	uint8_t stall_state;
+	uint8_t pad;
+	uint16_t n_stalls;
+	/* Observer estimates, Q16.16 counts per tick (per tick) */
+	int32_t velocity;
+	int32_t accel;
 };
 
-struct motor motors[] = {
-	[HBRIDGE_A] = {
-		.channel = HBRIDGE_A,
-		.pc_channel = PC_CH1,
-	},
-	[HBRIDGE_B] = {
-		.channel = HBRIDGE_B,
-		.pc_channel = PC_CH2,
-	},
+/* Sent when a motor's stall state changes */
+#define MOTOR_STALL_PACKET 16
+
+struct motor_stall_data {
+	uint32_t timestamp;
+	uint8_t channel;
+	uint8_t state;
+	uint16_t duty;
+	uint16_t n_stalls;
+	uint16_t n_faults;
 };
 
 const struct gain gains[] = {
-	{ FP_VAL(-130), 0, 0 },
-	{ FP_VAL(-50), 0, 0 },
-	{ FP_VAL(-10), 0, 0 },
-	{ FP_VAL(-5), 0, 0 },
-	{ FP_VAL(-2), 0, 0 },
-	{ FP_VAL(-1), 0, 0 },
+	{ Q16(-130), 0, 0 },
+	{ Q16(-50), 0, 0 },
+	{ Q16(-10), 0, 0 },
+	{ Q16(-5), 0, 0 },
+	{ Q16(-2), 0, 0 },
+	{ Q16(-1), 0, 0 },
 	/*
-	{ FP_VAL(-1), 0, 0 },
-	{ FP_VAL(-3), 0, 0 },
-	{ FP_VAL(-5), 0, 0 },
-	{ FP_VAL(-8), 0, 0 },
-	{ FP_VAL(-25), 0, 0 },
-	{ FP_VAL(-60), 0, 0 },
-	{ FP_VAL(-100), 0, 0 },
-
-	{ FP_VAL(-130), 0, 0 },
-	{ FP_VAL(-200), 0, 0 },
+	{ Q16(-1), 0, 0 },
+	{ Q16(-3), 0, 0 },
+	{ Q16(-5), 0, 0 },
+	{ Q16(-8), 0, 0 },
+	{ Q16(-25), 0, 0 },
+	{ Q16(-60), 0, 0 },
+	{ Q16(-100), 0, 0 },
+
+	{ Q16(-130), 0, 0 },
+	{ Q16(-200), 0, 0 },
 	*/
 };
 
@@ -104,27 +218,155 @@ const uint16_t gs_limits[] = {
 	*/
 };
 
-struct period_counter pc = {
-	.timer = TIM4,
+static struct hbridge hbridges[] = {
+	{
+		.timer = TIM2,
+		.port = GPIOA,
+		.pins = GPIO_TIM2_CH1_ETR | GPIO_TIM2_CH2 |
+			GPIO_TIM2_CH3 | GPIO_TIM2_CH4,
+		.nchannels = 2,
+		.channels = {
+			[HBRIDGE_A] = {
+				.ch1 = TIM_OC1,
+				.ch2 = TIM_OC2,
+			},
+			[HBRIDGE_B] = {
+				.ch1 = TIM_OC3,
+				.ch2 = TIM_OC4,
+			},
+		},
+	},
+};
+
+#define MOTOR_N_HBRIDGES (sizeof(hbridges) / sizeof(hbridges[0]))
+
+#ifdef QUADRATURE_ENCODER
+/* Each one's timer needs an ISR below, for the edge captures */
+static struct encoder encoders[] = {
+	{
+		.timer = TIM4,
+		.irq = NVIC_TIM4_IRQ,
+		.port = GPIOB,
+		.pins = GPIO_TIM4_CH1 | GPIO_TIM4_CH2,
+	},
+	{
+		.timer = TIM1,
+		.irq = NVIC_TIM1_CC_IRQ,
+		.port = GPIOA,
+		.pins = GPIO_TIM1_CH1 | GPIO_TIM1_CH2,
+	},
+};
+#else
+/*
+ * Each one's timer needs an ISR below. TIM4 is the only one the H-bridges,
+ * ADC trigger and control tick leave free.
+ */
+static struct period_counter period_counters[] = {
+	{
+		.timer = TIM4,
+		.irq = NVIC_TIM4_IRQ,
+		.port = GPIOB,
+		.pins = GPIO_TIM4_CH1 | GPIO_TIM4_CH2,
+#ifdef PERIOD_COUNTER_DMA
+		.channels = {
+			[PC_CH1] = { .dma = DMA_CHANNEL1 },
+			[PC_CH2] = { .dma = DMA_CHANNEL4 },
+		},
+#endif
+	},
 };
 
-struct hbridge hb = {
-	.timer = TIM2,
-	.a = {
-		.ch1 = TIM_OC1,
-		.ch2 = TIM_OC2,
+#define MOTOR_N_PCS (sizeof(period_counters) / sizeof(period_counters[0]))
+#endif
+
+/*
+ * The motors, which can be spread over as many H-bridges and feedback
+ * timers as there are. MOTOR_N must match.
+ */
+static const struct motor_config motor_configs[] = {
+	[MOTOR_A] = {
+		.hb = &hbridges[0],
+		.hb_channel = HBRIDGE_A,
+#ifdef QUADRATURE_ENCODER
+		.enc = &encoders[0],
+#else
+		.pc = &period_counters[0],
+		.pc_channel = PC_CH1,
+#endif
+		.adc_input = ADC_MOTOR_A_CURRENT,
 	},
-	.b = {
-		.ch1 = TIM_OC3,
-		.ch2 = TIM_OC4,
+	[MOTOR_B] = {
+		.hb = &hbridges[0],
+		.hb_channel = HBRIDGE_B,
+#ifdef QUADRATURE_ENCODER
+		.enc = &encoders[1],
+#else
+		.pc = &period_counters[0],
+		.pc_channel = PC_CH2,
+#endif
+		.adc_input = ADC_MOTOR_B_CURRENT,
 	},
 };
 
+_Static_assert(sizeof(motor_configs) / sizeof(motor_configs[0]) == MOTOR_N,
+	       "motor_configs must have MOTOR_N entries");
+
+static struct motor motors[MOTOR_N];
+
+#define PID_TIMER_PRESCALER 7100
+#define PID_TIMER_PERIOD    500
+
+/* Length of one control tick in period counter units (TIM4 prescaler 710) */
+#define PID_TICK_PERIOD ((PID_TIMER_PERIOD * (PID_TIMER_PRESCALER + 1)) / (710 + 1))
+/* CPU cycles per period counter unit, the CPU runs at the timer clock */
+#define MOTOR_CYCLES_PER_UNIT (710 + 1)
+/*
+ * A reversing motor is considered stopped when it's slower than this, or
+ * after MOTOR_REVERSE_TIMEOUT ticks of braking
+ */
+#define MOTOR_REVERSE_PERIOD  (PID_TICK_PERIOD * MOTOR_COUNTS_PER_EDGE)
+#define MOTOR_REVERSE_TIMEOUT 10
+/* Length of one control tick in microseconds (72 MHz timer clock) */
+#define PID_TICK_US ((PID_TIMER_PERIOD * (PID_TIMER_PRESCALER + 1)) / 72)
+
+/*
+ * Current sense scaling, depends on the board. 0.806 mA per count is a
+ * 0.1 R shunt with a gain of 10 into a 3.3 V, 12-bit ADC.
+ */
+#define MOTOR_CURRENT_SCALE  Q16(0.806)
+#define MOTOR_CURRENT_OFFSET 0
+#define MOTOR_CURRENT_FILTER 2
+
+/*
+ * Battery sense scaling, 3.223 mV per count is a 1:4 divider into a 3.3 V,
+ * 12-bit ADC.
+ */
+#define MOTOR_BATTERY_SCALE  Q16(3.223)
+#define MOTOR_BATTERY_OFFSET 0
+
+/* Default stall detection settings */
+#define MOTOR_STALL_DUTY       40000
+#define MOTOR_STALL_TIMEOUT_MS 500
+#define MOTOR_STALL_BACKOFF    20000
+#define MOTOR_STALL_FAULT_MS   2000
+
+#define MS_TO_TICKS(_ms) (((_ms) * 1000) / PID_TICK_US)
+
+/* Default observer settings, no duty feed-forward */
+#define MOTOR_OBSERVER_ALPHA Q15(0.5)
+#define MOTOR_OBSERVER_BETA  Q15(0.15)
+#define MOTOR_OBSERVER_KB    0
+
+/* Position loop proportional gain, (counts/tick) per count of error */
+#define MOTOR_POSITION_KP Q16(0.5)
+/* Position error (counts) which is considered "on target" */
+#define MOTOR_POSITION_DEADBAND 1
+
 static void pid_timer_init(uint32_t timer)
 {
 	timer_reset(timer);
 	timer_slave_set_mode(timer, TIM_SMCR_SMS_OFF);
-	timer_set_prescaler(timer, 7100);
+	timer_set_prescaler(timer, PID_TIMER_PRESCALER);
 	timer_set_mode(timer, TIM_CR1_CKD_CK_INT,
 		       TIM_CR1_CMS_EDGE, TIM_CR1_DIR_UP);
 	timer_enable_preload(timer);
@@ -134,7 +376,7 @@ static void pid_timer_init(uint32_t timer)
 
 	timer_enable_irq(timer, TIM_DIER_UIE);
 	nvic_enable_irq(NVIC_TIM3_IRQ);
-	timer_set_period(timer, 500);
+	timer_set_period(timer, PID_TIMER_PERIOD);
 }
 
 static void pid_timer_enable(uint32_t timer)
@@ -147,62 +389,511 @@ static void pid_timer_disable(uint32_t timer)
 	timer_disable_counter(timer);
 }
 
-void motor_set_speed(enum hbridge_channel channel, enum direction dir,
+#ifdef QUADRATURE_ENCODER
+#define MOTOR_COUNTS_PER_EDGE ENCODER_COUNTS_PER_EDGE
+
+static void motor_feedback_init(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(encoders) / sizeof(encoders[0]); i++) {
+		encoder_init(&encoders[i]);
+	}
+}
+
+/* The encoders always run, so that position is tracked even when stopped */
+static void motor_feedback_enable(struct motor *m)
+{
+	(void)m;
+}
+
+static void motor_feedback_disable(struct motor *m)
+{
+	(void)m;
+}
+
+static void motor_feedback_tick(void)
+{
+}
+
+/* The period comes from the encoder's edge times, whichever way it turns */
+static void motor_feedback_update(struct motor *m)
+{
+	struct encoder *enc = m->cfg->enc;
+	int32_t cycles;
+
+	encoder_update(enc);
+	cycles = encoder_estimate(enc);
+
+	m->count = (uint32_t)encoder_get_position(enc);
+	if (m->cfg->invert) {
+		m->count = -m->count;
+		cycles = -cycles;
+	}
+
+	if (m->dir == DIRECTION_REV) {
+		cycles = -cycles;
+	}
+
+	m->backwards = cycles < 0;
+	if (cycles) {
+		uint64_t period = ((uint64_t)abs(cycles) * MOTOR_COUNTS_PER_EDGE) /
+				  MOTOR_CYCLES_PER_UNIT;
+
+		m->period = period ? period : 1;
+	} else {
+		m->period = 0;
+	}
+}
+
+static void motor_feedback_isr(uint32_t timer)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(encoders) / sizeof(encoders[0]); i++) {
+		if (encoders[i].timer == timer) {
+			encoder_capture(&encoders[i]);
+		}
+	}
+}
+
+void tim4_isr(void)
+{
+	motor_feedback_isr(TIM4);
+}
+
+void tim1_cc_isr(void)
+{
+	motor_feedback_isr(TIM1);
+}
+#else
+#define MOTOR_COUNTS_PER_EDGE 1
+
+static void motor_feedback_init(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < MOTOR_N_PCS; i++) {
+		if (period_counters[i].timer != TIM4) {
+			log_err("No ISR for period counter %u\n", i);
+			continue;
+		}
+
+		period_counter_init(&period_counters[i]);
+	}
+}
+
+static void motor_feedback_enable(struct motor *m)
+{
+	/* Enabling again would drop edges which haven't been counted yet */
+	if (m->feedback) {
+		return;
+	}
+
+	period_counter_enable(m->cfg->pc, m->cfg->pc_channel);
+	m->pc_total = period_counter_get_total(m->cfg->pc, m->cfg->pc_channel);
+	m->feedback = true;
+}
+
+static void motor_feedback_disable(struct motor *m)
+{
+	period_counter_disable(m->cfg->pc, m->cfg->pc_channel);
+	m->feedback = false;
+}
+
+static void motor_feedback_update(struct motor *m)
+{
+	struct period_counter *pc = m->cfg->pc;
+	uint32_t total;
+	int32_t count;
+
+	m->period = period_counter_estimate(pc, m->cfg->pc_channel);
+
+	/* Never reset, so no edges are lost between reading and resetting */
+	total = period_counter_get_total(pc, m->cfg->pc_channel);
+	count = total - m->pc_total;
+	m->pc_total = total;
+	if (m->dir== DIRECTION_FWD) {
+		m->count += count;
+	} else if (m->dir == DIRECTION_REV) {
+		m->count -= count;
+	}
+}
+
+static void motor_feedback_tick(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < MOTOR_N_PCS; i++) {
+		period_counter_autorange(&period_counters[i]);
+	}
+}
+
+static void motor_feedback_isr(uint32_t timer)
+{
+	unsigned int i;
+
+	for (i = 0; i < MOTOR_N_PCS; i++) {
+		if (period_counters[i].timer == timer) {
+			period_counter_update(&period_counters[i]);
+		}
+	}
+}
+
+void tim4_isr(void)
+{
+	motor_feedback_isr(TIM4);
+}
+#endif
+
+static void motor_send_data(struct motor *m, uint16_t duty, uint32_t period)
+{
+	struct spi_pl_packet *pkt = spi_alloc_packet();
+	if (pkt) {
+		struct motor_data *d = (struct motor_data *)pkt->data;
+		pkt->type = 15;
+		d->timestamp = msTicks;
+		d->channel = m->id;
+		d->direction = m->dir;
+		d->duty = duty;
+		d->period = period;
+		d->count = m->count;
+		d->current = current_sense_get(&m->current);
+		d->battery = battery_get_mv();
+		d->stall_state = m->stall.state;
+		d->n_stalls = m->stall.n_stalls;
+		d->velocity = observer_get_velocity(&m->obs);
+		d->accel = observer_get_accel(&m->obs);
+
+		spi_send_packet(pkt);
+	}
+}
+
+static void motor_send_stall(struct motor *m, uint16_t duty)
+{
+	struct spi_pl_packet *pkt = spi_alloc_packet();
+	if (pkt) {
+		struct motor_stall_data *d = (struct motor_stall_data *)pkt->data;
+		pkt->type = MOTOR_STALL_PACKET;
+		d->timestamp = msTicks;
+		d->channel = m->id;
+		d->state = m->stall.state;
+		d->duty = duty;
+		d->n_stalls = m->stall.n_stalls;
+		d->n_faults = m->stall.n_faults;
+
+		spi_send_packet(pkt);
+	}
+}
+
+static void motor_hb_set_duty(struct motor *m, uint16_t duty)
+{
+	enum direction dir = m->dir;
+
+	if (m->cfg->invert) {
+		dir = dir == DIRECTION_FWD ? DIRECTION_REV : DIRECTION_FWD;
+	}
+
+	hbridge_set_duty(m->cfg->hb, m->cfg->hb_channel, dir, duty);
+}
+
+static void motor_hb_set_decay(struct motor *m, enum hbridge_decay decay)
+{
+	hbridge_set_decay(m->cfg->hb, m->cfg->hb_channel, decay);
+}
+
+/*
+ * Brake until the motor stops, then start again in the new direction with
+ * the duty scaled for the new speed, rather than dropping out for a tick
+ * and carrying the old duty over.
+ */
+static void motor_start_reversal(struct motor *m, enum direction dir,
+				 uint16_t speed)
+{
+	uint32_t duty = ((uint64_t)m->duty * m->setpoint) / speed;
+
+	if (duty > 0xffff) {
+		duty = 0xffff;
+	} else if (duty < 3000) {
+		duty = 3000;
+	}
+
+	m->new_dir = dir;
+	m->reverse_duty = duty;
+	m->reverse_ticks = 0;
+	m->reversing = true;
+}
+
+static bool motor_reverse_tick(struct motor *m)
+{
+	/* m->dir is still the old direction, so period is too */
+	bool stopped = !m->period || m->period > MOTOR_REVERSE_PERIOD;
+
+	if (!stopped && ++m->reverse_ticks < MOTOR_REVERSE_TIMEOUT) {
+		m->output = 0;
+		motor_hb_set_decay(m, HBRIDGE_BRAKE);
+		motor_send_data(m, 0, m->period);
+		return false;
+	}
+
+	m->reversing = false;
+	m->dir = m->new_dir;
+	m->duty = m->reverse_duty;
+	/* Make sure the new direction gets written out */
+	m->output = 0;
+	controller_reset(&m->controller);
+
+	return true;
+}
+
+void motor_set_speed(enum motor_id id, enum direction dir,
 		     uint16_t speed)
 {
-	struct motor *m = &motors[channel];
+	struct motor *m = &motors[id];
 
 	if (speed == 0) {
-		period_counter_disable(&pc, m->pc_channel);
+		if (m->mode == MOTOR_MODE_POSITION) {
+			/*
+			 * Holding position, so keep counting. The period counter
+			 * can't tell direction, so edges while stopped count the
+			 * way the motor was last driven.
+			 */
+			dir = m->dir;
+		} else {
+			motor_feedback_disable(m);
+		}
 
 		if (m->setpoint != 0) {
-			struct spi_pl_packet *pkt = spi_alloc_packet();
-			if (pkt) {
-				struct motor_data *d = (struct motor_data *)pkt->data;
-				pkt->type = 15;
-				d->timestamp = msTicks;
-				d->channel = m->channel;
-				d->direction = m->dir;
-				d->duty = 0;
-				d->period = 0;
-				d->count = m->count;
-
-				spi_send_packet(pkt);
-			}
+			motor_send_data(m, 0, 0);
 		}
 
 		m->dir = dir;
+		m->reversing = false;
 		m->setpoint = 0;
 		controller_set(&m->controller, 0);
 		return;
 	} else if (m->setpoint == 0) {
-		m->enabling = 10;
-		period_counter_enable(&pc, m->pc_channel);
+		motor_feedback_enable(m);
+		m->dir = dir;
 	}
 
-	if (dir != m->dir) {
-		m->changing_direction = 1;
+	if (dir == m->dir) {
+		/* Cancels any reversal in progress */
+		m->reversing = false;
+	} else if (!m->reversing) {
+		motor_start_reversal(m, dir, speed);
+	} else {
+		m->new_dir = dir;
 	}
 
-	m->dir = dir;
 	m->setpoint = speed;
 	controller_set(&m->controller, speed);
 }
 
+/* Convert a direction and period setpoint to Q16.16 counts per tick */
+static int32_t motor_period_to_velocity(enum direction dir, uint32_t period)
+{
+	int32_t vel;
+
+	if (period == 0) {
+		return 0;
+	}
+
+	vel = ((uint64_t)(PID_TICK_PERIOD * MOTOR_COUNTS_PER_EDGE) << 16) / period;
+
+	return dir == DIRECTION_REV ? -vel : vel;
+}
+
+/* The way the motor is actually turning */
+static enum direction motor_get_direction(struct motor *m)
+{
+	if (m->backwards) {
+		return m->dir == DIRECTION_FWD ? DIRECTION_REV : DIRECTION_FWD;
+	}
+
+	return m->dir;
+}
+
+/* Measured velocity, in Q16.16 counts per tick */
+static int32_t motor_get_velocity(struct motor *m)
+{
+	if (m->setpoint == 0) {
+		return 0;
+	}
+
+	return motor_period_to_velocity(motor_get_direction(m), m->period);
+}
+
+/* Convert a speed in Q16.16 counts per tick to a period setpoint */
+static uint16_t motor_speed_to_period(uint32_t speed)
+{
+	uint64_t period;
+
+	if (!speed) {
+		return 0;
+	}
+
+	period = ((uint64_t)(PID_TICK_PERIOD * MOTOR_COUNTS_PER_EDGE) << 16) / speed;
+	if (period > 0xffff) {
+		/* Too slow to measure */
+		return 0;
+	}
+
+	return period;
+}
+
+/* Set a velocity in Q16.16 counts per tick */
+static void motor_set_velocity(struct motor *m, int32_t vel)
+{
+	enum direction dir = vel < 0 ? DIRECTION_REV : DIRECTION_FWD;
+	uint32_t speed = vel < 0 ? -vel : vel;
+
+	motor_set_speed(m->id, dir, motor_speed_to_period(speed));
+}
+
+/* Convert counts per second to Q16.16 counts per tick */
+static int32_t motor_velocity_to_tick(uint32_t vel)
+{
+	return ((uint64_t)vel << 16) * PID_TICK_US / 1000000;
+}
+
+/* Convert counts per second^2 to Q16.16 counts per tick^2 */
+static int32_t motor_accel_to_tick(uint32_t accel)
+{
+	return (((uint64_t)accel << 16) * PID_TICK_US / 1000000) * PID_TICK_US / 1000000;
+}
+
+/* Convert counts per second^3 to Q16.16 counts per tick^3 */
+static int32_t motor_jerk_to_tick(uint32_t jerk)
+{
+	return motor_accel_to_tick(jerk) * (uint64_t)PID_TICK_US / 1000000;
+}
+
+static void motor_set_limits(struct motor *m, uint32_t accel, uint32_t jerk)
+{
+	m->mode = MOTOR_MODE_SPEED;
+	ramp_set_limits(&m->ramp, motor_accel_to_tick(accel), motor_jerk_to_tick(jerk));
+	ramp_reset(&m->ramp, motor_period_to_velocity(m->dir, m->setpoint));
+}
+
+/*
+ * Speed mode setpoints go via the ramp (if enabled), which is advanced by
+ * motor_tick().
+ */
+static void motor_request_speed(struct motor *m, enum direction dir,
+				uint16_t speed)
+{
+	if (m->mode != MOTOR_MODE_SPEED) {
+		m->mode = MOTOR_MODE_SPEED;
+		ramp_reset(&m->ramp, motor_period_to_velocity(m->dir, m->setpoint));
+	}
+
+	if (!ramp_enabled(&m->ramp)) {
+		motor_set_speed(m->id, dir, speed);
+		return;
+	}
+
+	ramp_set_target(&m->ramp, motor_period_to_velocity(dir, speed));
+}
+
+void motor_request_velocity(enum motor_id id, int32_t vel)
+{
+	enum direction dir = vel < 0 ? DIRECTION_REV : DIRECTION_FWD;
+	uint32_t speed = motor_velocity_to_tick(vel < 0 ? -vel : vel);
+
+	motor_request_speed(&motors[id], dir, motor_speed_to_period(speed));
+}
+
+int32_t motor_get_count(enum motor_id id)
+{
+	return motors[id].count;
+}
+
+static void motor_publish(struct motor *m)
+{
+	seqlock_write_begin(&m->lock);
+	m->state.timestamp = msTicks;
+	m->state.count = m->count;
+	m->state.period = m->period;
+	m->state.velocity = motor_get_velocity(m);
+	m->state.duty = m->duty;
+	m->state.dir = m->dir;
+	seqlock_write_end(&m->lock);
+}
+
+void motor_get_state(enum motor_id id, struct motor_state *state)
+{
+	struct motor *m = &motors[id];
+	uint32_t seq;
+
+	do {
+		seq = seqlock_read_begin(&m->lock);
+		*state = m->state;
+	} while (seqlock_read_retry(&m->lock, seq));
+}
+
+static void motor_set_position(struct motor *m, int32_t target,
+			       uint32_t vmax, uint32_t amax)
+{
+	struct motor_state state;
+
+	/* Start from where the last tick left it, not half way through one */
+	motor_get_state(m->id, &state);
+
+	m->mode = MOTOR_MODE_SPEED;
+	profile_start(&m->profile, state.count, state.velocity, target,
+		      motor_velocity_to_tick(vmax), motor_accel_to_tick(amax));
+	m->mode = MOTOR_MODE_POSITION;
+}
+
+/*
+ * Outer loop of the position cascade: feed the profile velocity forward and
+ * correct for position error, then hand it to the speed controller.
+ */
+static void motor_position_tick(struct motor *m)
+{
+	int32_t err;
+	int64_t vel;
+
+	profile_tick(&m->profile);
+
+	err = profile_get_position(&m->profile) - (int32_t)m->count;
+	if (profile_done(&m->profile) &&
+	    err <= MOTOR_POSITION_DEADBAND && err >= -MOTOR_POSITION_DEADBAND) {
+		motor_set_velocity(m, 0);
+		return;
+	}
+
+	vel = profile_get_velocity(&m->profile) +
+	      ((int64_t)err * (int32_t)MOTOR_POSITION_KP);
+	if (vel > INT32_MAX) {
+		vel = INT32_MAX;
+	} else if (vel < -INT32_MAX) {
+		vel = -INT32_MAX;
+	}
+
+	motor_set_velocity(m, vel);
+}
+
 void motor_disable_loop()
 {
+	unsigned int i;
+
 	pid_timer_disable(TIM3);
-	period_counter_disable(&pc, PC_CH1);
-	period_counter_disable(&pc, PC_CH2);
+	for (i = 0; i < MOTOR_N; i++) {
+		motor_feedback_disable(&motors[i]);
+	}
 }
 
 void motor_enable_loop()
 {
+	unsigned int i;
+
 	motor_disable_loop();
-	controller_reset(&motors[HBRIDGE_A].controller);
-	controller_reset(&motors[HBRIDGE_B].controller);
-	period_counter_enable(&pc, PC_CH1);
-	period_counter_enable(&pc, PC_CH2);
+	for (i = 0; i < MOTOR_N; i++) {
+		controller_reset(&motors[i].controller);
+		motor_feedback_enable(&motors[i]);
+	}
 	pid_timer_enable(TIM3);
 }
 
@@ -216,121 +907,680 @@ static uint8_t gain_schedule(uint32_t point)
 	return gs_idx;
 }
 
-static void motor_tick(struct motor *m)
+static enum hbridge_decay motor_get_decay(struct motor *m)
 {
-	int32_t delta;
-	int32_t count;
-	uint8_t gs_idx;
+	if (m->decay == MOTOR_DECAY_SLOW) {
+		return HBRIDGE_DECAY_SLOW;
+	} else if (m->decay == MOTOR_DECAY_AUTO) {
+		/* A longer period than we have is slower than we're going */
+		if (m->period && m->setpoint > m->period) {
+			return HBRIDGE_DECAY_SLOW;
+		}
+	}
 
-	if (m->setpoint == 0) {
-		m->duty = 0;
-		hbridge_set_duty(&hb, m->channel, m->dir, 0);
+	return HBRIDGE_DECAY_FAST;
+}
+
+static bool motor_can_sync(struct motor *m)
+{
+	return m->setpoint && !m->reversing && m->mode == MOTOR_MODE_SPEED;
+}
+
+/* Limit a trim to half of the velocity, so it never changes direction */
+static q16_t motor_sync_clamp(q16_t trim, int32_t vel)
+{
+	int32_t max = (vel < 0 ? -vel : vel) / 2;
+
+	return q_clamp(trim, -max, max);
+}
+
+/*
+ * Call once per control tick after the motors, the trims are applied on
+ * the next tick.
+ */
+static void motor_sync_tick(struct motor_sync *s, struct motor *a,
+			    struct motor *b)
+{
+	int32_t va, vb, da, db, corr;
+	int64_t norm;
+
+	da = a->count - s->last_a;
+	db = b->count - s->last_b;
+	s->last_a = a->count;
+	s->last_b = b->count;
+
+	if (!s->gain || !motor_can_sync(a) || !motor_can_sync(b)) {
+		s->valid = false;
+		a->trim = b->trim = 0;
 		return;
 	}
 
-	if (m->changing_direction) {
-		hbridge_set_duty(&hb, m->channel, m->dir, 0);
-		m->changing_direction = 0;
+	if (!s->valid) {
+		s->err = 0;
+		s->valid = true;
 		return;
 	}
 
-	m->period = period_counter_get(&pc, m->pc_channel);
-	if (m->enabling && m->period != 0) {
-		m->period = 0;
-		m->enabling = 0;
+	va = motor_period_to_velocity(a->dir, a->setpoint);
+	vb = motor_period_to_velocity(b->dir, b->setpoint);
+	norm = (int64_t)(va < 0 ? -va : va) + (vb < 0 ? -vb : vb);
+
+	/* Travel difference, normalised so it's 0 when the ratio is right */
+	s->err += (((int64_t)da * vb - (int64_t)db * va) << 16) / norm;
+	s->err = q_clamp(s->err, -(MOTOR_SYNC_LIMIT << 16), MOTOR_SYNC_LIMIT << 16);
+
+	corr = q16_mul(s->err, s->gain);
+	a->trim = motor_sync_clamp(-((int64_t)corr * vb) / norm, va);
+	b->trim = motor_sync_clamp(((int64_t)corr * va) / norm, vb);
+}
+
+void motor_limit_forward(int32_t vel)
+{
+	forward_limit = vel < 0 ? -1 : motor_velocity_to_tick(vel);
+}
+
+/*
+ * Scale all of the setpoints so that the mean velocity is within the
+ * forward limit. Turning on the spot or reversing is never limited.
+ */
+static void motor_apply_forward_limit(void)
+{
+	int32_t limit = forward_limit;
+	q16_t scale = Q16_ONE;
+	int64_t mean = 0;
+	unsigned int i;
+
+	for (i = 0; i < MOTOR_N; i++) {
+		mean += motor_period_to_velocity(motors[i].dir, motors[i].setpoint);
 	}
+	mean /= MOTOR_N;
 
-	count = period_counter_get_total(&pc, m->pc_channel);
-	period_counter_reset_total(&pc, m->pc_channel);
-	if (m->dir== DIRECTION_FWD) {
-		m->count += count;
-	} else if (m->dir == DIRECTION_REV) {
-		m->count -= count;
+	if (limit >= 0 && mean > limit) {
+		scale = ((int64_t)limit << 16) / mean;
+	}
+
+	for (i = 0; i < MOTOR_N; i++) {
+		motors[i].limit_scale = scale;
 	}
+}
 
-	uint64_t mid = (m->period + m->setpoint) >> 1;
+/*
+ * The motor's setpoint, adjusted by any sync trim and forward limit. 0 if
+ * the forward limit makes it too slow to run at.
+ */
+static uint32_t motor_get_effective_setpoint(struct motor *m)
+{
+	int32_t vel;
 
-	gs_idx = gain_schedule(mid);
-	delta = controller_tick(&m->controller, m->period, gs_idx);
-	if (!delta)
+	if (!m->trim && m->limit_scale == Q16_ONE) {
+		return m->setpoint;
+	}
+
+	vel = motor_period_to_velocity(m->dir, m->setpoint) + m->trim;
+	if (m->limit_scale == Q16_ONE) {
+		uint32_t period = motor_speed_to_period(vel < 0 ? -vel : vel);
+
+		/* Too slow to measure with the trim, so ignore it */
+		return period ? period : m->setpoint;
+	}
+
+	vel = q16_mul(vel, m->limit_scale);
+
+	return motor_speed_to_period(vel < 0 ? -vel : vel);
+}
+
+/*
+ * Track the speed with the observer, and give the controller the filtered
+ * speed and rate of change of the period. With period = K / v that's
+ * -period * a / v.
+ */
+static void motor_observe(struct motor *m)
+{
+	q16_t vel, accel;
+
+	if (m->setpoint == 0 || m->reversing) {
+		observer_reset(&m->obs);
 		return;
+	}
+
+	observer_update(&m->obs,
+			motor_period_to_velocity(m->backwards ? DIRECTION_REV : DIRECTION_FWD,
+						 m->period),
+			m->duty);
+
+	vel = observer_get_velocity(&m->obs);
+	accel = observer_get_accel(&m->obs);
+	if (m->period && vel > 0) {
+		controller_set_pv_rate(&m->controller,
+				       q_sat32(-((int64_t)m->period * accel) / vel));
+		/* 2^32 / period, from counts per tick */
+		controller_set_pv_speed(&m->controller,
+					q_sat32(((int64_t)vel << 16) /
+						(PID_TICK_PERIOD * MOTOR_COUNTS_PER_EDGE)));
+	}
+}
+
+static void motor_tick(struct motor *m)
+{
+	int32_t delta;
+	uint16_t duty, output;
+	uint8_t gs_idx;
+	uint32_t count = m->count;
+	uint32_t setpoint;
+	uint32_t start;
+	enum stall_state stall;
+	bool moved;
+
+	/* Only what motor_observe() provides this tick, even if we return early */
+	controller_clear_pv(&m->controller);
+
+	motor_feedback_update(m);
+	moved = m->count != count;
+	motor_observe(m);
+	current_sense_update(&m->current, adc_get(m->cfg->adc_input));
+
+	if (m->mode == MOTOR_MODE_POSITION) {
+		motor_position_tick(m);
+	} else if (ramp_enabled(&m->ramp)) {
+		motor_set_velocity(m, ramp_tick(&m->ramp));
+	}
+
+	setpoint = motor_get_effective_setpoint(m);
+	if (setpoint == 0) {
+		/* Always brake if it's the forward limit stopping us */
+		bool brake = m->stop_brake || m->setpoint != 0;
 
-	if ((delta < 0) && (-delta > (int32_t)m->duty)) {
 		m->duty = 0;
-	} else if (m->duty + delta > 0xffff) {
-		m->duty = 0xffff;
+		m->output = 0;
+		stall_clear(&m->stall);
+		motor_hb_set_decay(m, brake ? HBRIDGE_BRAKE : HBRIDGE_DECAY_FAST);
+		motor_hb_set_duty(m, 0);
+		return;
+	}
+
+	if (m->backwards && !m->reversing) {
+		if (m->period <= MOTOR_REVERSE_PERIOD) {
+			/*
+			 * Turning the wrong way, pushed or still coasting. Brake
+			 * it to a stop first, as for a reversal, rather than have
+			 * the controller take it for stopped and nudge the duty.
+			 */
+			motor_start_reversal(m, m->dir, m->setpoint);
+		} else {
+			/* Creeping the wrong way, which is as good as stopped */
+			m->period = 0;
+		}
+	}
+
+	if (m->reversing) {
+		if (!motor_reverse_tick(m)) {
+			return;
+		}
+
+		/* The feedback is still from the old direction, so skip a tick */
+		delta = 0;
 	} else {
-		m->duty += delta;
+		uint64_t mid = (m->period + setpoint) >> 1;
+
+		controller_set(&m->controller, setpoint);
+
+		gs_idx = gain_schedule(mid);
+		if (gs_idx >= sizeof(gains) / sizeof(gains[0]) && m->period > setpoint) {
+			/*
+			 * Slower than the gain schedule goes, which is where the
+			 * no-edge bound of a stalled wheel ends up. Call it stopped,
+			 * so the controller nudges the duty instead of giving up.
+			 */
+			m->period = 0;
+			gs_idx = gain_schedule(setpoint >> 1);
+		}
+		start = dwt_read_cycle_counter();
+		delta = controller_tick(&m->controller, m->period, gs_idx);
+		m->tick_cycles = dwt_read_cycle_counter() - start;
+		m->gs_idx = gs_idx;
 	}
 
-	if (m->duty < 3000) {
-		m->duty = 3000;
+	if (delta) {
+		if ((delta < 0) && (-delta > (int32_t)m->duty)) {
+			m->duty = 0;
+		} else if (m->duty + delta > 0xffff) {
+			m->duty = 0xffff;
+		} else {
+			m->duty += delta;
+		}
+
+		if (m->duty < 3000) {
+			m->duty = 3000;
+		}
 	}
-	hbridge_set_duty(&hb, m->channel, m->dir, m->duty);
 
-	struct spi_pl_packet *pkt = spi_alloc_packet();
-	if (pkt) {
-		struct motor_data *d = (struct motor_data *)pkt->data;
-		pkt->type = 15;
-		d->timestamp = msTicks;
-		d->channel = m->channel;
-		d->direction = m->dir;
-		d->duty = m->duty;
-		d->period = m->period;
-		d->count = m->count;
+	/* The current limit overrides the speed controller */
+	duty = current_limit_apply(&m->current, m->duty);
 
-		spi_send_packet(pkt);
+	/* And stall protection overrides both */
+	stall = m->stall.state;
+	if (stall_update(&m->stall, moved, duty,
+			 setpoint / (PID_TICK_PERIOD * MOTOR_COUNTS_PER_EDGE) + 1) != stall) {
+		motor_send_stall(m, duty);
 	}
+	duty = stall_limit(&m->stall, duty);
+
+	/*
+	 * m->duty is the effort at the nominal battery voltage, scale it
+	 * to what the battery can actually deliver.
+	 */
+	output = battery_compensate(duty);
+
+	motor_hb_set_decay(m, motor_get_decay(m));
+	if (!delta && duty == m->duty && output == m->output)
+		return;
+
+	m->duty = duty;
+	m->output = output;
+	motor_hb_set_duty(m, m->output);
+
+	motor_send_data(m, m->duty, m->period);
 }
 
-void tim3_isr(void)
+static void motor_set_decay(struct motor *m, uint8_t decay, bool stop_brake)
 {
-	timer_clear_flag(TIM3, TIM_SR_UIF);
-	motor_tick(&motors[HBRIDGE_A]);
-	motor_tick(&motors[HBRIDGE_B]);
+	if (decay > MOTOR_DECAY_AUTO) {
+		log_err("Invalid decay mode (%d)\n", decay);
+		return;
+	}
+
+	m->decay = decay;
+	m->stop_brake = stop_brake;
 }
 
-void tim4_isr(void)
+static int16_t motor_trace_term(int32_t term)
 {
-	period_counter_update(&pc);
+	if (term > INT16_MAX)
+		return INT16_MAX;
+	else if (term < INT16_MIN)
+		return INT16_MIN;
+
+	return term;
+}
+
+static void motor_trace(struct motor *m)
+{
+	struct trace_sample s = {
+		.timestamp = msTicks,
+		.channel = m->id,
+		.gs_idx = m->gs_idx,
+		.duty = m->duty,
+		.setpoint = m->setpoint,
+		.period = m->period,
+		.err = m->controller.err,
+		.ierr = m->controller.ierr,
+		.p = motor_trace_term(m->controller.tc),
+		.i = motor_trace_term(m->controller.ti),
+		.d = motor_trace_term(m->controller.td),
+		.stall = m->stall.state,
+		.vel = observer_get_velocity(&m->obs),
+		.accel = observer_get_accel(&m->obs),
+		.cycles = m->tick_cycles,
+	};
+
+	trace_record(&s);
+}
+
+void tim3_isr(void)
+{
+	unsigned int i;
+
+	timer_clear_flag(TIM3, TIM_SR_UIF);
+	battery_update(adc_get(ADC_BATTERY));
+
+	/* All of the motors' new duties go out in the same PWM period */
+	for (i = 0; i < MOTOR_N_HBRIDGES; i++) {
+		hbridge_begin_update(&hbridges[i]);
+	}
+	schedule_tick(msTicks);
+	trajectory_tick(msTicks);
+	reflex_tick();
+	motor_apply_forward_limit();
+	for (i = 0; i < MOTOR_N; i++) {
+		motor_tick(&motors[i]);
+		motor_publish(&motors[i]);
+	}
+	for (i = 0; i < MOTOR_N_HBRIDGES; i++) {
+		hbridge_commit_update(&hbridges[i]);
+	}
+	/* Keep the current samples inside the (new) drive pulses */
+	adc_set_sample_point(hbridge_get_sample_point(&hbridges[0]));
+	for (i = 0; i < MOTOR_N_SYNCS; i++) {
+		motor_sync_tick(&syncs[i], &motors[2 * i], &motors[2 * i + 1]);
+	}
+	for (i = 0; i < MOTOR_N; i++) {
+		motor_trace(&motors[i]);
+	}
+	motor_feedback_tick();
+
+	drive_tick();
 }
 
+/*
+ * Each command carries settings for two motors, starting at 'first'. This
+ * used to be the top of a 32-bit type, so old hosts send 0.
+ */
+#define MOTOR_CMD_N 2
+
 enum motor_type {
 	MOTOR_SET = 0,
+	MOTOR_POSITION = 1,
+	MOTOR_LIMITS = 2,
+	MOTOR_CURRENT_LIMIT = 3,
+	MOTOR_BATTERY = 4,
+	MOTOR_DECAY = 5,
+	MOTOR_STALL = 6,
+	MOTOR_CONTROLLER = 7,
+	MOTOR_OBSERVER = 8,
+	MOTOR_SYNC = 9,
+	MOTOR_GAINS = 10,
 };
 
 struct motor_cmd_set {
 	struct {
 		enum direction dir;
 		uint32_t setpoint;
-	} motors[2];
+	} motors[MOTOR_CMD_N];
+};
+
+/*
+ * Move to an absolute position (counts), with velocity (counts/s) and
+ * acceleration (counts/s^2) limits.
+ */
+struct motor_cmd_position {
+	struct {
+		int32_t target;
+		uint32_t vmax;
+		uint32_t amax;
+	} motors[MOTOR_CMD_N];
+};
+
+/*
+ * Speed mode acceleration (counts/s^2) and jerk (counts/s^3) limits.
+ * An acceleration limit of 0 applies setpoints immediately, and a jerk
+ * limit of 0 only limits acceleration.
+ */
+struct motor_cmd_limits {
+	struct {
+		uint32_t accel;
+		uint32_t jerk;
+	} motors[MOTOR_CMD_N];
+};
+
+/* Current limit in mA, 0 for no limit */
+struct motor_cmd_current_limit {
+	uint32_t limit[MOTOR_CMD_N];
+};
+
+/*
+ * Nominal battery voltage in mV which duty values are relative to, 0 to
+ * disable compensation. Needs a BATTERY_SENSE build.
+ */
+struct motor_cmd_battery {
+	uint32_t nominal;
+};
+
+/*
+ * Decay mode (enum motor_decay), and whether to brake (1) or coast (0) when
+ * stopped.
+ */
+struct motor_cmd_decay {
+	struct {
+		uint8_t decay;
+		uint8_t stop_brake;
+	} motors[MOTOR_CMD_N];
+};
+
+/*
+ * Stall detection. A motor is stalled if it doesn't move for timeout ms
+ * (or longer at low speeds) with more than 'duty'. The duty is then limited
+ * to 'backoff', and if it still doesn't move for fault ms it's turned off
+ * until the setpoint goes to 0 or this is sent again. 'duty' of 0 disables.
+ */
+struct motor_cmd_stall {
+	struct {
+		uint16_t duty;
+		uint16_t timeout;
+		uint16_t backoff;
+		uint16_t fault;
+	} motors[MOTOR_CMD_N];
+};
+
+/*
+ * Speed control strategy (enum controller_strategy) and its parameters,
+ * see controller.h.
+ */
+struct motor_cmd_controller {
+	struct {
+		uint8_t strategy;
+		uint8_t pad[3];
+		int32_t params[CONTROLLER_N_PARAMS];
+	} motors[MOTOR_CMD_N];
+};
+
+/*
+ * Observer gains, alpha and beta are Q1.15 and kb (acceleration per unit of
+ * duty change) is Q16.16.
+ */
+struct motor_cmd_observer {
+	struct {
+		uint16_t alpha;
+		uint16_t beta;
+		int32_t kb;
+	} motors[MOTOR_CMD_N];
+};
+
+/*
+ * Cross-coupling gain for the pair of motors starting at 'first', which
+ * must be even. (counts/tick) of trim per count of error, Q16.16, 0 to
+ * disable.
+ */
+struct motor_cmd_sync {
+	int32_t gain;
+};
+
+/*
+ * PID gains, Q16.16, to use instead of the gain schedule. All 0 goes back
+ * to the schedule.
+ */
+struct motor_cmd_gains {
+	struct {
+		int32_t Kc;
+		int32_t Kd;
+		int32_t Ki;
+	} motors[MOTOR_CMD_N];
 };
 
 struct motor_cmd {
-	enum motor_type type;
+	/* enum motor_type */
+	uint8_t type;
+	uint8_t first;
+	uint8_t pad[2];
 	union {
 		/* type == MOTOR_SET */
 		struct motor_cmd_set set;
+		/* type == MOTOR_POSITION */
+		struct motor_cmd_position position;
+		/* type == MOTOR_LIMITS */
+		struct motor_cmd_limits limits;
+		/* type == MOTOR_CURRENT_LIMIT */
+		struct motor_cmd_current_limit current_limit;
+		/* type == MOTOR_BATTERY */
+		struct motor_cmd_battery battery;
+		/* type == MOTOR_DECAY */
+		struct motor_cmd_decay decay;
+		/* type == MOTOR_STALL */
+		struct motor_cmd_stall stall;
+		/* type == MOTOR_CONTROLLER */
+		struct motor_cmd_controller controller;
+		/* type == MOTOR_OBSERVER */
+		struct motor_cmd_observer observer;
+		/* type == MOTOR_SYNC */
+		struct motor_cmd_sync sync;
+		/* type == MOTOR_GAINS */
+		struct motor_cmd_gains gains;
 	} payloads;
 };
 
+static void motor_process_cmd(struct motor_cmd *cmd, struct motor *m,
+			      unsigned int i)
+{
+	if (cmd->type == MOTOR_SET) {
+		struct motor_cmd_set *set = &cmd->payloads.set;
+		motor_request_speed(m, set->motors[i].dir, set->motors[i].setpoint);
+	} else if (cmd->type == MOTOR_POSITION) {
+		struct motor_cmd_position *pos = &cmd->payloads.position;
+		motor_set_position(m, pos->motors[i].target,
+				   pos->motors[i].vmax, pos->motors[i].amax);
+	} else if (cmd->type == MOTOR_LIMITS) {
+		struct motor_cmd_limits *lim = &cmd->payloads.limits;
+		motor_set_limits(m, lim->motors[i].accel, lim->motors[i].jerk);
+	} else if (cmd->type == MOTOR_CURRENT_LIMIT) {
+		struct motor_cmd_current_limit *cl = &cmd->payloads.current_limit;
+		current_sense_set_limit(&m->current, cl->limit[i]);
+	} else if (cmd->type == MOTOR_DECAY) {
+		struct motor_cmd_decay *dc = &cmd->payloads.decay;
+		motor_set_decay(m, dc->motors[i].decay, dc->motors[i].stop_brake);
+	} else if (cmd->type == MOTOR_STALL) {
+		struct motor_cmd_stall *st = &cmd->payloads.stall;
+		stall_configure(&m->stall, st->motors[i].duty,
+				MS_TO_TICKS(st->motors[i].timeout),
+				st->motors[i].backoff,
+				MS_TO_TICKS(st->motors[i].fault));
+	} else if (cmd->type == MOTOR_CONTROLLER) {
+		struct motor_cmd_controller *ct = &cmd->payloads.controller;
+		if (controller_set_strategy(&m->controller, ct->motors[i].strategy,
+					    ct->motors[i].params)) {
+			log_err("Invalid controller (%d)\n", ct->motors[i].strategy);
+		}
+	} else if (cmd->type == MOTOR_OBSERVER) {
+		struct motor_cmd_observer *ob = &cmd->payloads.observer;
+		if (ob->motors[i].alpha > Q15_MAX || ob->motors[i].beta > Q15_MAX) {
+			log_err("Invalid observer gains\n");
+			return;
+		}
+		observer_configure(&m->obs, ob->motors[i].alpha, ob->motors[i].beta,
+				   ob->motors[i].kb);
+	} else if (cmd->type == MOTOR_GAINS) {
+		struct motor_cmd_gains *g = &cmd->payloads.gains;
+		controller_set_gains(&m->controller, g->motors[i].Kc,
+				     g->motors[i].Kd, g->motors[i].Ki);
+	}
+}
+
 void motor_process_packet(struct spi_pl_packet *pkt)
 {
 	struct motor_cmd *cmd = (struct motor_cmd *)pkt->data;
+	unsigned int i;
 
-	if (cmd->type == MOTOR_SET) {
-		struct motor_cmd_set *set = &cmd->payloads.set;
-		motor_set_speed(HBRIDGE_A, set->motors[0].dir, set->motors[0].setpoint);
-		motor_set_speed(HBRIDGE_B, set->motors[1].dir, set->motors[1].setpoint);
+	if (cmd->type == MOTOR_BATTERY) {
+		battery_set_nominal(cmd->payloads.battery.nominal);
+		return;
+	} else if (cmd->type == MOTOR_SYNC) {
+		if ((cmd->first & 1) || cmd->first / 2 >= MOTOR_N_SYNCS) {
+			log_err("Invalid motor pair (%d)\n", cmd->first);
+			return;
+		}
+		syncs[cmd->first / 2].gain = cmd->payloads.sync.gain;
+		return;
+	}
+
+	if (cmd->first >= MOTOR_N) {
+		log_err("Invalid motor (%d)\n", cmd->first);
+		return;
+	}
+
+	for (i = 0; i < MOTOR_CMD_N && cmd->first + i < MOTOR_N; i++) {
+		motor_process_cmd(cmd, &motors[cmd->first + i], i);
+	}
+}
+
+/*
+ * H-bridge PWM configuration. The packet is returned with the resulting
+ * configuration filled in.
+ */
+struct motor_pwm_cmd {
+	/* Hz, 0 to only read back the current configuration */
+	uint32_t freq;
+	/* Use the full timer clock for twice the resolution */
+	uint8_t hires;
+	/* Centre-aligned PWM, with the motors interleaved */
+	uint8_t centre_aligned;
+	uint8_t pad[2];
+	/* Returned: duty steps per PWM period */
+	uint32_t resolution;
+};
+
+#define MOTOR_PWM_MIN_FREQ 1000
+#define MOTOR_PWM_MAX_FREQ 100000
+
+void motor_pwm_process_packet(struct spi_pl_packet *pkt)
+{
+	struct motor_pwm_cmd *cmd = (struct motor_pwm_cmd *)pkt->data;
+	/* All of the H-bridges are set the same, report the first */
+	struct hbridge *hb = &hbridges[0];
+	unsigned int i;
+
+	if ((pkt->type != EP_PWM) || (pkt->flags & SPI_FLAG_ERROR))
+		return;
+
+	if (cmd->freq) {
+		if (cmd->freq < MOTOR_PWM_MIN_FREQ || cmd->freq > MOTOR_PWM_MAX_FREQ) {
+			log_err("PWM frequency out of range (%lu)\n", cmd->freq);
+		} else {
+			for (i = 0; i < MOTOR_N_HBRIDGES; i++) {
+				if ((bool)cmd->centre_aligned != hbridges[i].centre_aligned) {
+					hbridge_set_centre_aligned(&hbridges[i],
+								   cmd->centre_aligned);
+				}
+				hbridge_set_freq(&hbridges[i], cmd->freq, cmd->hires);
+			}
+			adc_sync_pwm(hb->timer);
+		}
 	}
+
+	cmd->freq = hb->freq;
+	cmd->hires = hb->hires;
+	cmd->centre_aligned = hb->centre_aligned;
+	cmd->resolution = hb->resolution;
 }
 
 void motor_init()
 {
-	hbridge_init(&hb);
-	period_counter_init(&pc);
-	pid_timer_init(TIM3);
+	unsigned int i;
 
-	controller_init(&motors[HBRIDGE_A].controller, gains, sizeof(gains) / sizeof(gains[0]));
-	controller_init(&motors[HBRIDGE_B].controller, gains, sizeof(gains) / sizeof(gains[0]));
+	for (i = 0; i < MOTOR_N_HBRIDGES; i++) {
+		hbridge_init(&hbridges[i]);
+	}
+	/* The ADC is synchronised to the first H-bridge */
+	adc_init(hbridges[0].timer);
+	battery_init(MOTOR_BATTERY_SCALE, MOTOR_BATTERY_OFFSET);
+
+	for (i = 0; i < MOTOR_N; i++) {
+		struct motor *m = &motors[i];
+
+		m->cfg = &motor_configs[i];
+		m->id = i;
+		m->limit_scale = Q16_ONE;
+		seqlock_init(&m->lock);
+		stall_configure(&m->stall, MOTOR_STALL_DUTY,
+				MS_TO_TICKS(MOTOR_STALL_TIMEOUT_MS), MOTOR_STALL_BACKOFF,
+				MS_TO_TICKS(MOTOR_STALL_FAULT_MS));
+		observer_configure(&m->obs, MOTOR_OBSERVER_ALPHA,
+				   MOTOR_OBSERVER_BETA, MOTOR_OBSERVER_KB);
+		current_sense_init(&m->current, MOTOR_CURRENT_SCALE,
+				   MOTOR_CURRENT_OFFSET, MOTOR_CURRENT_FILTER);
+		controller_init(&m->controller, gains, sizeof(gains) / sizeof(gains[0]));
+	}
+
+	/* For timing the controller, see tick_cycles */
+	dwt_enable_cycle_counter();
+
+	motor_feedback_init();
+	pid_timer_init(TIM3);
 }
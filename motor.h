@@ -22,10 +22,50 @@
 #include "spi.h"
 #include "hbridge.h"
 
+#define EP_PWM 23
+
+/*
+ * Number of motors, which must match the table in motor.c. Commands
+ * address the motors in pairs.
+ */
+#define MOTOR_N 2
+
+/* Index into the motor table. Motors A and B are the left and right wheels */
+enum motor_id {
+	MOTOR_A = 0,
+	MOTOR_B,
+	MOTOR_C,
+	MOTOR_D,
+};
+
 void motor_init(void);
 void motor_disable_loop(void);
 void motor_enable_loop(void);
 void motor_process_packet(struct spi_pl_packet *pkt);
-void motor_set_speed(enum hbridge_channel channel, enum direction dir,
+/* Configure the H-bridge PWM, the reply should be sent back */
+void motor_pwm_process_packet(struct spi_pl_packet *pkt);
+void motor_set_speed(enum motor_id id, enum direction dir,
 		     uint16_t speed);
+/* Request a signed velocity in counts per second (subject to ramp limits) */
+void motor_request_velocity(enum motor_id id, int32_t vel);
+int32_t motor_get_count(enum motor_id id);
+
+/* A consistent copy of a motor's state, as of its last control tick */
+struct motor_state {
+	uint32_t timestamp;
+	int32_t count;
+	uint32_t period;
+	/* Measured velocity, Q16.16 counts per tick */
+	int32_t velocity;
+	uint16_t duty;
+	enum direction dir;
+};
+
+/* Must not be called from an interrupt above the control tick */
+void motor_get_state(enum motor_id id, struct motor_state *state);
+/*
+ * Limit the mean forward velocity of the motors to vel counts per second,
+ * by scaling all of their setpoints. -1 for no limit.
+ */
+void motor_limit_forward(int32_t vel);
 #endif /* __MOTOR_H__ */
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fixed.h"
+#include "observer.h"
+
+void observer_configure(struct observer *o, q15_t alpha, q15_t beta, q16_t kb)
+{
+	o->alpha = alpha;
+	o->beta = beta;
+	o->kb = kb;
+
+	observer_reset(o);
+}
+
+void observer_reset(struct observer *o)
+{
+	o->vel = 0;
+	o->accel = 0;
+	o->valid = false;
+}
+
+void observer_update(struct observer *o, q16_t vel, uint16_t duty)
+{
+	q16_t pvel, paccel, resid;
+
+	if (!o->valid) {
+		o->vel = vel;
+		o->accel = 0;
+		o->duty = duty;
+		o->valid = true;
+		return;
+	}
+
+	/* Predict */
+	pvel = q16_add_sat(o->vel, o->accel);
+	paccel = q16_add_sat(o->accel, q_sat32((int64_t)o->kb * ((int32_t)duty - o->duty)));
+	o->duty = duty;
+
+	/* Correct */
+	resid = q16_sub_sat(vel, pvel);
+	o->vel = q16_add_sat(pvel, q15_scale(resid, o->alpha, Q_ROUND_NEAREST));
+	o->accel = q16_add_sat(paccel, q15_scale(resid, o->beta, Q_ROUND_NEAREST));
+}
+
+q16_t observer_get_velocity(struct observer *o)
+{
+	return o->vel;
+}
+
+q16_t observer_get_accel(struct observer *o)
+{
+	return o->accel;
+}
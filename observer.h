@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __OBSERVER_H__
+#define __OBSERVER_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fixed.h"
+
+/*
+ * Alpha-beta observer of a wheel's velocity and acceleration. Each tick
+ * the state is predicted forwards, with the change in duty pushing the
+ * acceleration, and then corrected towards the measured velocity.
+ * Velocities are Q16.16 counts per tick, accelerations per tick^2.
+ */
+struct observer {
+	/* Set these with observer_configure() */
+	q15_t alpha;
+	q15_t beta;
+	/* Acceleration per unit change in duty, Q16.16 */
+	q16_t kb;
+
+	/* These will be updated dynamically */
+	q16_t vel;
+	q16_t accel;
+	uint16_t duty;
+	bool valid;
+};
+
+void observer_configure(struct observer *o, q15_t alpha, q15_t beta, q16_t kb);
+/* Start again from the next measurement */
+void observer_reset(struct observer *o);
+/* Call once per control tick, with the measured velocity and applied duty */
+void observer_update(struct observer *o, q16_t vel, uint16_t duty);
+q16_t observer_get_velocity(struct observer *o);
+q16_t observer_get_accel(struct observer *o);
+
+#endif /* __OBSERVER_H__ */
@@ -16,63 +16,287 @@
  */
 #include <stdbool.h>
 #include <stdint.h>
-#include <string.h>
 
 #include <libopencm3/cm3/cortex.h>
 #include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/dma.h>
 #include <libopencm3/stm32/gpio.h>
 
+#include "log.h"
 #include "period_counter.h"
 
-void period_counter_update(struct period_counter *pc)
+static struct period_counter_channel *get_channel(struct period_counter *pc,
+						  enum pc_channel ch)
 {
-	if (timer_get_flag(pc->timer, TIM_SR_UIF)) {
-		timer_clear_flag(pc->timer, TIM_SR_UIF);
+	if (ch >= PC_MAX_CHANNELS)
+		return NULL;
+
+	return &pc->channels[ch];
+}
+
+/*
+ * Use the fine timebase while the fastest channel's period is comfortably
+ * within one wrap of the counter, with some hysteresis. Fine units.
+ */
+#define PC_FINE_BELOW   40000
+#define PC_COARSE_ABOVE 55000
+
+#ifdef PERIOD_COUNTER_DMA
+/* Capture events raise DMA requests */
+#define PC_CC_EVENT(_ch) (TIM_DIER_CC1DE << (_ch))
+#else
+#define PC_CC_EVENT(_ch) (TIM_DIER_CC1IE << (_ch))
+#endif
+#define PC_CC_FLAG(_ch) (TIM_SR_CC1IF << (_ch))
+/* The capture/compare registers are consecutive */
+#define PC_CCR(_timer, _ch) (&TIM_CCR1(_timer))[(_ch)]
+
+static const enum tim_ic_input pc_inputs[PC_MAX_CHANNELS] = {
+	[PC_CH1] = TIM_IC_IN_TI1,
+	[PC_CH2] = TIM_IC_IN_TI2,
+	[PC_CH3] = TIM_IC_IN_TI3,
+	[PC_CH4] = TIM_IC_IN_TI4,
+};
+
+/* Convert an extended count in the current timebase to fine units */
+static uint32_t period_counter_to_fine(struct period_counter *pc, uint32_t raw)
+{
+	return pc->base + raw * pc->scale;
+}
+
+static uint32_t period_counter_normalise(uint32_t fine)
+{
+	uint32_t ret = (fine + PC_FINE_PER_UNIT / 2) / PC_FINE_PER_UNIT;
+
+	/* 0 means stopped */
+	return (fine && !ret) ? 1 : ret;
+}
+
+/*
+ * Extend a 16-bit timer value to a 32-bit fine timestamp using the overflow
+ * count. Call it from the period counter interrupt, with it masked, or
+ * inside a read of pc->lock, which is retried if the interrupt ran.
+ */
+static uint32_t period_counter_timestamp(struct period_counter *pc, uint16_t cnt)
+{
+	uint32_t ovf = pc->ovf;
+
+	/*
+	 * If there's an overflow which hasn't been counted yet, and cnt is
+	 * small, then cnt was latched after the overflow.
+	 */
+	if (timer_get_flag(pc->timer, TIM_SR_UIF) && (cnt < 0x8000))
+		ovf++;
+
+	return period_counter_to_fine(pc, (ovf << 16) | cnt);
+}
 
-		if (pc->ch1.active)
-			pc->ch1.ovf++;
-		if (pc->ch2.active)
-			pc->ch2.ovf++;
+static void channel_record(struct period_counter_channel *c, uint32_t ts)
+{
+	c->period = ts - c->last;
+	c->last = ts;
+	c->total++;
+	c->sem = true;
+}
+
+static void channel_capture(struct period_counter *pc,
+			    struct period_counter_channel *c, uint16_t cc)
+{
+	channel_record(c, period_counter_timestamp(pc, cc));
+}
+
+#ifdef PERIOD_COUNTER_DMA
+/*
+ * Must be called more often than the counter wraps: ~72 ms on the fine
+ * timebase, ~650 ms on the coarse.
+ */
+static uint32_t period_counter_now(struct period_counter *pc)
+{
+	uint16_t cnt = TIM_CNT(pc->timer);
+
+	pc->now += (uint16_t)(cnt - pc->now);
+
+	return pc->now;
+}
+
+static uint16_t channel_dma_head(struct period_counter_channel *c)
+{
+	return (PC_RING_LEN - DMA_CNDTR(DMA1, c->dma)) & (PC_RING_LEN - 1);
+}
+
+/* Whether the DMA wrote ring[idx] going from c->tail to head */
+static bool channel_dma_passed(struct period_counter_channel *c,
+			       uint16_t head, uint16_t idx)
+{
+	return ((idx - c->tail) & (PC_RING_LEN - 1)) <
+	       ((head - c->tail) & (PC_RING_LEN - 1));
+}
+
+/*
+ * Whether the DMA has lapped c->tail since the last call. The half and full
+ * transfer flags are set when the last entry of each half of the ring is
+ * written, so one the head didn't pass on its way from the tail means it
+ * went round again. A whole extra lap can only be missed when the batch
+ * itself passes both.
+ */
+static bool channel_dma_overrun(struct period_counter_channel *c)
+{
+	uint32_t flags = 0;
+	uint16_t head;
+
+	if (dma_get_interrupt_flag(DMA1, c->dma, DMA_HTIF))
+		flags |= DMA_HTIF;
+	if (dma_get_interrupt_flag(DMA1, c->dma, DMA_TCIF))
+		flags |= DMA_TCIF;
+	/* Only what was seen, one set since is for the next call */
+	dma_clear_interrupt_flags(DMA1, c->dma, flags);
+
+	/* After the flags, so an edge which set one is counted as passed */
+	head = channel_dma_head(c);
+
+	if ((flags & DMA_HTIF) &&
+	    !channel_dma_passed(c, head, PC_RING_LEN / 2 - 1))
+		return true;
+	if ((flags & DMA_TCIF) &&
+	    !channel_dma_passed(c, head, PC_RING_LEN - 1))
+		return true;
+
+	return false;
+}
+
+/*
+ * Record the edges captured since the last call. Their timestamps are
+ * extended working backwards from now, which is fine as long as they are
+ * all from within the last counter wrap.
+ */
+static void channel_process(struct period_counter *pc, enum pc_channel ch)
+{
+	struct period_counter_channel *c = get_channel(pc, ch);
+	/* Read the DMA position first, so every edge is before 'now' */
+	uint16_t head = channel_dma_head(c);
+	bool overrun = channel_dma_overrun(c);
+	uint16_t newest, prev;
+	uint32_t now, ts;
+
+	seqlock_write_begin(&pc->lock);
+	now = period_counter_now(pc);
+	if (head == c->tail && !overrun) {
+		seqlock_write_end(&pc->lock);
+		return;
 	}
 
-	if (timer_get_flag(pc->timer, TIM_SR_CC1IF)) {
-		struct period_counter_channel *c = &pc->ch1;
-		uint16_t cc = TIM_CCR1(TIM4);
-		c->period = ((c->ovf << 16) + cc) - c->cnt;
-		c->ovf = 0;
-		c->cnt = cc;
-		c->total++;
-		c->sem = true;
+	newest = c->ring[(head - 1) & (PC_RING_LEN - 1)];
+	ts = now - (uint16_t)((uint16_t)now - newest);
 
-		timer_clear_flag(pc->timer, TIM_SR_CC1IF);
+	if (overrun) {
+		/*
+		 * An unknown number of edges were lost, so drop the batch. The
+		 * newest capture is still good to measure the next period from.
+		 */
+		c->last = period_counter_to_fine(pc, ts);
+		c->tail = head;
+		c->sem = false;
+		c->ref_total = c->total;
+		c->ref_valid = false;
+		seqlock_write_end(&pc->lock);
+		log_warn("Period counter ring overrun (%d)\n", ch);
+		return;
 	}
 
-	if (timer_get_flag(pc->timer, TIM_SR_CC2IF)) {
-		struct period_counter_channel *c = &pc->ch2;
-		uint16_t cc = TIM_CCR2(TIM4);
-		c->period = ((c->ovf << 16) + cc) - c->cnt;
-		c->ovf = 0;
-		c->cnt = cc;
-		c->total++;
-		c->sem = true;
+	prev = c->ring[c->tail];
+	ts -= (uint16_t)(newest - prev);
+
+	while (c->tail != head) {
+		uint16_t cc = c->ring[c->tail];
 
-		timer_clear_flag(pc->timer, TIM_SR_CC2IF);
+		ts += (uint16_t)(cc - prev);
+		prev = cc;
+		channel_record(c, period_counter_to_fine(pc, ts));
+
+		c->tail = (c->tail + 1) & (PC_RING_LEN - 1);
 	}
+	seqlock_write_end(&pc->lock);
+}
+
+static void channel_init_dma(struct period_counter *pc, enum pc_channel ch)
+{
+	struct period_counter_channel *c = get_channel(pc, ch);
+	uint8_t dma = c->dma;
+	volatile uint32_t *ccr = &PC_CCR(pc->timer, ch);
+
+	dma_channel_reset(DMA1, dma);
+	dma_set_read_from_peripheral(DMA1, dma);
+	dma_set_memory_size(DMA1, dma, DMA_CCR_MSIZE_16BIT);
+	dma_set_peripheral_size(DMA1, dma, DMA_CCR_PSIZE_16BIT);
+	dma_enable_memory_increment_mode(DMA1, dma);
+	dma_disable_peripheral_increment_mode(DMA1, dma);
+	dma_enable_circular_mode(DMA1, dma);
+	dma_set_priority(DMA1, dma, DMA_CCR_PL_HIGH);
+	dma_set_peripheral_address(DMA1, dma, (uint32_t)ccr);
+	dma_set_memory_address(DMA1, dma, (uint32_t)c->ring);
+	dma_set_number_of_data(DMA1, dma, PC_RING_LEN);
+	dma_enable_channel(DMA1, dma);
+}
+#endif
+
+void period_counter_update(struct period_counter *pc)
+{
+	unsigned int ch;
+
+	seqlock_write_begin(&pc->lock);
+	for (ch = 0; ch < PC_MAX_CHANNELS; ch++) {
+		if (timer_get_flag(pc->timer, PC_CC_FLAG(ch))) {
+			channel_capture(pc, &pc->channels[ch], PC_CCR(pc->timer, ch));
+			timer_clear_flag(pc->timer, PC_CC_FLAG(ch));
+		}
+	}
+
+	/* Overflow last, so that captures can be ordered against it */
+	if (timer_get_flag(pc->timer, TIM_SR_UIF)) {
+		timer_clear_flag(pc->timer, TIM_SR_UIF);
+		pc->ovf++;
+	}
+	seqlock_write_end(&pc->lock);
+}
+
+static void channel_reset(struct period_counter_channel *c)
+{
+	c->period = 0;
+	c->sem = false;
+	c->ref_total = c->total;
+	c->ref_valid = false;
+	c->estimate = 0;
 }
 
 void period_counter_init(struct period_counter *pc)
 {
 	uint32_t timer = pc->timer;
+	unsigned int ch;
+
+	pc->active = false;
+	seqlock_init(&pc->lock);
+	pc->ovf = 0;
+#ifdef PERIOD_COUNTER_DMA
+	pc->now = 0;
+#endif
+	pc->scale = PC_FINE_PER_UNIT;
+	pc->base = 0;
 
-	memset(pc, 0, sizeof(*pc));
-	pc->timer = timer;
+	for (ch = 0; ch < PC_MAX_CHANNELS; ch++) {
+		struct period_counter_channel *c = &pc->channels[ch];
 
-	gpio_set_mode(GPIOB, GPIO_MODE_INPUT,
-		      GPIO_CNF_INPUT_FLOAT,
-		      GPIO_TIM4_CH1 | GPIO_TIM4_CH2);
+		c->active = false;
+		c->last = 0;
+		c->total = 0;
+		c->total_base = 0;
+		channel_reset(c);
+	}
+
+	gpio_set_mode(pc->port, GPIO_MODE_INPUT,
+		      GPIO_CNF_INPUT_FLOAT, pc->pins);
 	timer_reset(timer);
 	timer_slave_set_mode(timer, TIM_SMCR_SMS_OFF);
-	timer_set_prescaler(timer, 710);
+	timer_set_prescaler(timer, (PC_FINE_CLOCKS * pc->scale) - 1);
 	timer_set_mode(timer, TIM_CR1_CKD_CK_INT,
 		       TIM_CR1_CMS_EDGE, TIM_CR1_DIR_UP);
 	timer_enable_preload(timer);
@@ -80,29 +304,42 @@ void period_counter_init(struct period_counter *pc)
 	timer_enable_update_event(timer);
 	timer_generate_event(timer, TIM_EGR_UG);
 
-	timer_ic_set_input(timer, TIM_IC1, TIM_IC_IN_TI1);
-	timer_ic_set_input(timer, TIM_IC2, TIM_IC_IN_TI2);
+	for (ch = 0; ch < PC_MAX_CHANNELS; ch++) {
+		timer_ic_set_input(timer, ch, pc_inputs[ch]);
+
+#ifdef PERIOD_COUNTER_DMA
+		/* No interrupts at all, everything is done from the control tick */
+		if (pc->channels[ch].dma)
+			channel_init_dma(pc, ch);
+#endif
+	}
 
+#ifndef PERIOD_COUNTER_DMA
 	timer_enable_irq(timer, TIM_DIER_UIE);
-	nvic_enable_irq(NVIC_TIM4_IRQ);
+	nvic_enable_irq(pc->irq);
+#endif
 }
 
 void period_counter_enable(struct period_counter *pc, enum pc_channel ch)
 {
+	struct period_counter_channel *c = get_channel(pc, ch);
+
+#ifdef PERIOD_COUNTER_DMA
+	if (!c->dma)
+		return;
+#endif
+
 	timer_ic_enable(pc->timer, ch);
 
-	switch (ch) {
-	case PC_CH1:
-		// TODO: reset channel...
-		pc->ch1.active = true;
-		timer_enable_irq(pc->timer, TIM_DIER_CC1IE);
-		break;
-	case PC_CH2:
-		// TODO: reset channel...
-		pc->ch2.active = true;
-		timer_enable_irq(pc->timer, TIM_DIER_CC2IE);
-		break;
-	}
+#ifdef PERIOD_COUNTER_DMA
+	/* Drop anything left over from before */
+	c->tail = channel_dma_head(c);
+	dma_clear_interrupt_flags(DMA1, c->dma, DMA_HTIF | DMA_TCIF);
+#endif
+
+	// TODO: reset channel...
+	c->active = true;
+	timer_enable_irq(pc->timer, PC_CC_EVENT(ch));
 
 	if (!pc->active) {
 		// TODO: reset counter...
@@ -113,88 +350,153 @@ void period_counter_enable(struct period_counter *pc, enum pc_channel ch)
 
 void period_counter_disable(struct period_counter *pc, enum pc_channel ch)
 {
+	struct period_counter_channel *c = get_channel(pc, ch);
+	unsigned int i;
+
 	timer_ic_disable(pc->timer, ch);
+	timer_disable_irq(pc->timer, PC_CC_EVENT(ch));
+	channel_reset(c);
+	c->active = false;
 
-	switch (ch) {
-	case PC_CH1:
-		timer_disable_irq(pc->timer, TIM_DIER_CC1IE);
-		pc->ch1.period = 0;
-		pc->ch1.ovf = 0;
-		pc->ch1.cnt = 0;
-		pc->ch1.sem = false;
-		pc->ch1.active = false;
-		break;
-	case PC_CH2:
-		timer_disable_irq(pc->timer, TIM_DIER_CC2IE);
-		pc->ch2.period = 0;
-		pc->ch2.ovf = 0;
-		pc->ch2.cnt = 0;
-		pc->ch2.sem = false;
-		pc->ch2.active = false;
-		break;
+	for (i = 0; i < PC_MAX_CHANNELS; i++) {
+		if (pc->channels[i].active)
+			return;
 	}
 
-	if (!pc->ch1.active && !pc->ch2.active) {
-		timer_disable_counter(pc->timer);
-		pc->active = false;
-	}
+	timer_disable_counter(pc->timer);
+	pc->active = false;
 }
 
 uint32_t period_counter_get(struct period_counter *pc, enum pc_channel ch)
 {
-	struct period_counter_channel *c;
-	switch (ch) {
-	case PC_CH1:
-		c = &pc->ch1;
-		break;
-	case PC_CH2:
-		c = &pc->ch2;
-		break;
-	default:
-		c = NULL;
-	}
+	struct period_counter_channel *c = get_channel(pc, ch);
 
 	if (c->active && c->sem) {
 		c->sem = false;
-		return c->period;
+		return period_counter_normalise(c->period);
 	}
 
 	return 0;
 }
 
-uint32_t period_counter_get_total(struct period_counter *pc, enum pc_channel ch)
+uint32_t period_counter_estimate(struct period_counter *pc, enum pc_channel ch)
 {
-	struct period_counter_channel *c;
-	switch (ch) {
-	case PC_CH1:
-		c = &pc->ch1;
-		break;
-	case PC_CH2:
-		c = &pc->ch2;
-		break;
-	default:
-		c = NULL;
+	struct period_counter_channel *c = get_channel(pc, ch);
+	uint32_t total, edges, last, now, elapsed;
+
+	if (!c->active)
+		return 0;
+
+#ifdef PERIOD_COUNTER_DMA
+	/* The captures are processed here, so they can't change under us */
+	channel_process(pc, ch);
+	total = c->total;
+	last = c->last;
+	now = period_counter_to_fine(pc, pc->now);
+#else
+	{
+		uint32_t seq;
+
+		do {
+			seq = seqlock_read_begin(&pc->lock);
+			total = c->total;
+			last = c->last;
+			now = period_counter_timestamp(pc, TIM_CNT(pc->timer));
+		} while (seqlock_read_retry(&pc->lock, seq));
 	}
+#endif
 
-	return c->total;
+	edges = total - c->ref_total;
+	c->ref_total = total;
+
+	if (edges) {
+		if (c->ref_valid)
+			c->estimate = (last - c->ref) / edges;
+
+		c->ref = last;
+		c->ref_valid = true;
+
+		return period_counter_normalise(c->estimate);
+	}
+
+	if (!c->estimate)
+		return 0;
+
+	/* No edges: the period must be at least the time since the last one */
+	elapsed = now - c->ref;
+	if (elapsed > c->estimate)
+		return period_counter_normalise(elapsed);
+
+	return period_counter_normalise(c->estimate);
 }
 
-void period_counter_reset_total(struct period_counter *pc, enum pc_channel ch)
+/*
+ * Switch timebase, restarting the counter. The timestamps carry on from
+ * where they were.
+ */
+static void period_counter_set_scale(struct period_counter *pc, uint8_t scale)
 {
-	struct period_counter_channel *c;
-	switch (ch) {
-	case PC_CH1:
-		c = &pc->ch1;
-		break;
-	case PC_CH2:
-		c = &pc->ch2;
-		break;
-	default:
-		c = NULL;
+	CM_ATOMIC_CONTEXT();
+
+#ifdef PERIOD_COUNTER_DMA
+	unsigned int ch;
+
+	for (ch = 0; ch < PC_MAX_CHANNELS; ch++) {
+		if (pc->channels[ch].active)
+			channel_process(pc, ch);
 	}
+	seqlock_write_begin(&pc->lock);
+	pc->base = period_counter_to_fine(pc, pc->now);
+	pc->now = 0;
+#else
+	/* Take any pending captures and overflows in the old timebase */
+	period_counter_update(pc);
+	seqlock_write_begin(&pc->lock);
+	pc->base = period_counter_timestamp(pc, TIM_CNT(pc->timer));
+	pc->ovf = 0;
+#endif
 
-	{
-		CM_ATOMIC_BLOCK();
-		c->total = 0;
+	pc->scale = scale;
+	timer_set_prescaler(pc->timer, (PC_FINE_CLOCKS * scale) - 1);
+	/* Update-on-overflow is set, so this doesn't raise UIF */
+	timer_generate_event(pc->timer, TIM_EGR_UG);
+	seqlock_write_end(&pc->lock);
+}
+
+void period_counter_autorange(struct period_counter *pc)
+{
+	uint32_t fastest = 0;
+	uint8_t scale = pc->scale;
+	unsigned int ch;
+
+	for (ch = 0; ch < PC_MAX_CHANNELS; ch++) {
+		struct period_counter_channel *c = &pc->channels[ch];
+
+		if (c->active && c->estimate &&
+		    (!fastest || c->estimate < fastest))
+			fastest = c->estimate;
 	}
+
+	if (fastest && fastest < PC_FINE_BELOW)
+		scale = 1;
+	else if (!fastest || fastest > PC_COARSE_ABOVE)
+		scale = PC_FINE_PER_UNIT;
+
+	if (scale != pc->scale)
+		period_counter_set_scale(pc, scale);
+}
+
+uint32_t period_counter_get_total(struct period_counter *pc, enum pc_channel ch)
+{
+	struct period_counter_channel *c = get_channel(pc, ch);
+
+	return c->total - c->total_base;
+}
+
+void period_counter_reset_total(struct period_counter *pc, enum pc_channel ch)
+{
+	struct period_counter_channel *c = get_channel(pc, ch);
+
+	/* 'total' is only ever written by the capture handling */
+	c->total_base = c->total;
 }
@@ -21,28 +21,95 @@
 #include <stdint.h>
 #include <libopencm3/stm32/timer.h>
 
+#include "seqlock.h"
+
+#ifdef PERIOD_COUNTER_DMA
+/*
+ * Captures are written to a ring by DMA, and processed in
+ * period_counter_estimate(). It must hold all of the edges in one control
+ * tick. Must be a power of two.
+ */
+#define PC_RING_LEN 128
+#endif
+
+/*
+ * The timer switches between a fine (79 timer clocks, ~1.1 us) and a coarse
+ * (711 timer clocks, ~9.9 us) timebase depending on how fast the wheels
+ * are turning. Internally everything is kept in fine units, and results
+ * are returned in coarse units, which is what they've always been.
+ */
+#define PC_FINE_CLOCKS   79
+#define PC_FINE_PER_UNIT 9
+
+/* Input capture channel, the same as enum tim_ic_id */
 enum pc_channel {
-	PC_CH1 = TIM_IC1,
-	PC_CH2 = TIM_IC2,
+	PC_CH1 = 0,
+	PC_CH2,
+	PC_CH3,
+	PC_CH4,
+
+	PC_MAX_CHANNELS,
 };
 
 struct period_counter_channel {
+#ifdef PERIOD_COUNTER_DMA
+	/* Initialise this: the DMA1 channel for this capture */
+	uint8_t dma;
+#endif
+
 	bool active;
 
-	uint32_t ovf;
-	uint32_t cnt;
 	uint32_t sem;
 
+	/* Extended (32-bit) timestamp of the most recent edge, fine units */
+	uint32_t last;
 	uint32_t period;
+	/* Edges ever seen, only written by the capture handling */
 	uint32_t total;
+	/* 'total' at the last period_counter_reset_total() */
+	uint32_t total_base;
+
+	/*
+	 * M/T estimator state. 'ref_total' is 'total' at the last estimate,
+	 * 'ref' is the timestamp of the last edge which was used in an
+	 * estimate.
+	 */
+	uint32_t ref_total;
+	uint32_t ref;
+	bool ref_valid;
+	uint32_t estimate;
+
+#ifdef PERIOD_COUNTER_DMA
+	volatile uint16_t ring[PC_RING_LEN];
+	uint16_t tail;
+#endif
 };
 
 struct period_counter {
+	/* Initialise these */
 	uint32_t timer;
+	uint8_t irq;
+	uint32_t port;
+	uint16_t pins;
+
 	bool active;
 
-	struct period_counter_channel ch1;
-	struct period_counter_channel ch2;
+	/*
+	 * Held while the captures and the extended counter are updated, so
+	 * they can be read together without masking the interrupt.
+	 */
+	struct seqlock lock;
+	uint32_t ovf;
+#ifdef PERIOD_COUNTER_DMA
+	/* Extended counter value, tracked without the overflow interrupt */
+	uint32_t now;
+#endif
+
+	/* Fine units per count, and the fine timestamp when it was set */
+	uint8_t scale;
+	uint32_t base;
+
+	struct period_counter_channel channels[PC_MAX_CHANNELS];
 };
 
 void period_counter_update(struct period_counter *pc);
@@ -50,6 +117,19 @@ void period_counter_init(struct period_counter *pc);
 void period_counter_enable(struct period_counter *pc, enum pc_channel ch);
 void period_counter_disable(struct period_counter *pc, enum pc_channel ch);
 uint32_t period_counter_get(struct period_counter *pc, enum pc_channel ch);
+/*
+ * Get an averaged period estimate, intended to be called once per control
+ * tick. All edges since the previous call are averaged over the time they
+ * span (M/T method). If there were no edges, the time since the last edge is
+ * used as an upper bound, so the estimate decays towards "stopped".
+ * Returns 0 until at least two edges have been seen.
+ */
+uint32_t period_counter_estimate(struct period_counter *pc, enum pc_channel ch);
+/*
+ * Pick the timebase for the fastest channel, intended to be called once
+ * per control tick after the estimates.
+ */
+void period_counter_autorange(struct period_counter *pc);
 uint32_t period_counter_get_total(struct period_counter *pc, enum pc_channel ch);
 void period_counter_reset_total(struct period_counter *pc, enum pc_channel ch);
 
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "profile.h"
+
+void profile_start(struct profile *p, int32_t pos, int32_t vel, int32_t target,
+		   int32_t vmax, int32_t amax)
+{
+	p->pos = (int64_t)pos << 16;
+	p->target = (int64_t)target << 16;
+	p->vel = vel;
+	p->vmax = vmax;
+	p->amax = amax > 0 ? amax : 1;
+	p->done = false;
+}
+
+void profile_tick(struct profile *p)
+{
+	int64_t dist = p->target - p->pos;
+	int64_t v, stop;
+	int dir = 1;
+
+	if (p->done) {
+		return;
+	}
+
+	/* Work in the direction of the target, to keep the sums simple */
+	if (dist < 0) {
+		dir = -1;
+		dist = -dist;
+	}
+	v = (int64_t)p->vel * dir;
+
+	/* Distance needed to stop from the current speed: v^2 / 2a */
+	stop = v > 0 ? (v * v) / (2 * (int64_t)p->amax) : 0;
+
+	if (v < 0) {
+		/* Moving away from the target, turn around */
+		v += p->amax;
+	} else if (stop >= dist) {
+		v -= p->amax;
+		if (v < p->amax) {
+			/* Always creep forwards, or we'd never arrive */
+			v = p->amax;
+		}
+	} else if (v < p->vmax) {
+		v += p->amax;
+		if (v > p->vmax) {
+			v = p->vmax;
+		}
+	} else if (v > p->vmax) {
+		v -= p->amax;
+		if (v < p->vmax) {
+			v = p->vmax;
+		}
+	}
+
+	if (v >= dist) {
+		/* Arrived */
+		p->pos = p->target;
+		p->vel = 0;
+		p->done = true;
+		return;
+	}
+
+	p->pos += v * dir;
+	p->vel = v * dir;
+}
+
+int32_t profile_get_position(struct profile *p)
+{
+	return p->pos >> 16;
+}
+
+int32_t profile_get_velocity(struct profile *p)
+{
+	return p->vel;
+}
+
+bool profile_done(struct profile *p)
+{
+	return p->done;
+}
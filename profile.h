@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Trapezoidal motion profile generator. Positions are in counts, and
+ * velocity/acceleration are in counts per tick (per tick^2), all Q16.16.
+ * profile_tick() should be called once per control tick.
+ */
+struct profile {
+	int64_t pos;
+	int64_t target;
+	int32_t vel;
+
+	int32_t vmax;
+	int32_t amax;
+
+	bool done;
+};
+
+void profile_start(struct profile *p, int32_t pos, int32_t vel, int32_t target,
+		   int32_t vmax, int32_t amax);
+void profile_tick(struct profile *p);
+int32_t profile_get_position(struct profile *p);
+int32_t profile_get_velocity(struct profile *p);
+bool profile_done(struct profile *p);
+
+#endif /* __PROFILE_H__ */
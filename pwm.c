@@ -14,30 +14,55 @@
  * You should have received a copy of the GNU Lesser General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/cm3/cortex.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/timer.h>
 #include <stdint.h>
 
 #include "pwm.h"
 
-void pwm_timer_set_freq(uint32_t timer_peripheral, uint32_t frequency)
+/* TIM2-4 run at 2x APB1, and TIM1 at APB2. 72 MHz either way */
+#define PWM_TIMER_CLK 72000000
+
+/*
+ * Counts before an update event in which compare values aren't written,
+ * comfortably longer than the writes take even at the full timer clock.
+ */
+#define PWM_UPDATE_GUARD 128
+
+static uint32_t pwm_timer_set_div(uint32_t timer_peripheral, uint32_t frequency,
+				  uint32_t pre)
 {
-	uint32_t pre = 1;
-	uint32_t div, period = 0;
-
-	/* Set prescaler */
-	div = 36000000 / frequency;
-	while (!period) {
-		if (div > 65535) {
-			pre++;
-			div = 36000000 / (frequency * pre);
-		} else {
-			period = div;
-		}
+	uint32_t period;
+	uint32_t clk = PWM_TIMER_CLK;
+
+	/* Centre-aligned counts up and down in each period */
+	if (TIM_CR1(timer_peripheral) & TIM_CR1_CMS_MASK) {
+		clk /= 2;
+	}
+
+	/* Smallest prescaler which fits the period in 16 bits */
+	period = clk / (frequency * (pre + 1));
+	while (period > 65535) {
+		pre++;
+		period = clk / (frequency * (pre + 1));
 	}
+
 	timer_set_prescaler(timer_peripheral, pre);
 	timer_set_period(timer_peripheral, period);
+
+	return period;
+}
+
+uint32_t pwm_timer_set_freq(uint32_t timer_peripheral, uint32_t frequency)
+{
+	/* Counter clock is at most 36 MHz */
+	return pwm_timer_set_div(timer_peripheral, frequency, 1);
+}
+
+uint32_t pwm_timer_set_freq_hires(uint32_t timer_peripheral, uint32_t frequency)
+{
+	return pwm_timer_set_div(timer_peripheral, frequency, 0);
 }
 
 void pwm_timer_init(uint32_t timer_peripheral, uint32_t frequency) {
@@ -73,11 +98,10 @@ void pwm_timer_init(uint32_t timer_peripheral, uint32_t frequency) {
 	timer_set_oc_polarity_high(timer_peripheral, TIM_OC4);
 	timer_enable_oc_preload(timer_peripheral, TIM_OC4);
 
-	/* Setup AFIO */
-	gpio_set_mode(GPIOA, GPIO_MODE_OUTPUT_50_MHZ,
-		      GPIO_CNF_OUTPUT_ALTFN_PUSHPULL,
-		      GPIO_TIM2_CH1_ETR | GPIO_TIM2_CH2 |
-		      GPIO_TIM2_CH3 | GPIO_TIM2_CH4);
+	/* The advanced timer's outputs are gated by MOE */
+	if (timer_peripheral == TIM1) {
+		timer_enable_break_main_output(timer_peripheral);
+	}
 }
 
 void pwm_timer_enable(uint32_t timer_peripheral) {
@@ -88,6 +112,61 @@ void pwm_timer_disable(uint32_t timer_peripheral) {
 	timer_disable_counter(timer_peripheral);
 }
 
+void pwm_timer_set_centre_aligned(uint32_t timer_peripheral, bool centre)
+{
+	timer_set_alignment(timer_peripheral,
+			    centre ? TIM_CR1_CMS_CENTER_1 : TIM_CR1_CMS_EDGE);
+}
+
+void pwm_timer_reload(uint32_t timer_peripheral)
+{
+	timer_generate_event(timer_peripheral, TIM_EGR_UG);
+}
+
+static bool pwm_timer_update_due(uint32_t timer_peripheral)
+{
+	uint32_t cnt = TIM_CNT(timer_peripheral);
+	uint32_t arr = TIM_ARR(timer_peripheral);
+	uint32_t cr1 = TIM_CR1(timer_peripheral);
+	uint32_t guard = PWM_UPDATE_GUARD;
+
+	/* Stopped, so it won't update until it's told to */
+	if (!(cr1 & TIM_CR1_CEN)) {
+		return false;
+	}
+
+	/* Don't wait forever at silly frequencies */
+	if (guard > arr / 4) {
+		guard = arr / 4;
+	}
+
+	/* Centre-aligned also updates at the bottom, on the way down */
+	if ((cr1 & TIM_CR1_CMS_MASK) && (cr1 & TIM_CR1_DIR_DOWN)) {
+		return cnt < guard;
+	}
+
+	return cnt > arr || arr - cnt < guard;
+}
+
+void pwm_timer_write_compare(uint32_t timer_peripheral, const uint32_t *channels,
+			     const uint16_t *values, unsigned int n)
+{
+	unsigned int i;
+
+	for (;;) {
+		CM_ATOMIC_CONTEXT();
+
+		if (pwm_timer_update_due(timer_peripheral)) {
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			timer_set_oc_value(timer_peripheral, channels[i], values[i]);
+		}
+		return;
+	}
+}
+
 void pwm_channel_enable(uint32_t timer_peripheral, uint32_t channel) {
 	timer_enable_oc_output(timer_peripheral, channel);
 }
@@ -98,8 +177,53 @@ void pwm_channel_disable(uint32_t timer_peripheral, uint32_t channel) {
 
 void pwm_channel_set_duty(uint32_t timer_peripheral, uint32_t channel,
 			  uint16_t duty) {
+	timer_set_oc_value(timer_peripheral, channel,
+			   pwm_duty_to_compare(timer_peripheral, duty, false));
+}
+
+uint16_t pwm_duty_to_count(uint32_t timer_peripheral, uint16_t duty)
+{
 	uint32_t period = TIM_ARR(timer_peripheral);
-	duty = (period * duty) >> 16;
 
-	timer_set_oc_value(timer_peripheral, channel, duty);
+	if (duty == PWM_DUTY_FULL) {
+		return period;
+	}
+
+	return (period * duty) >> 16;
+}
+
+void pwm_channel_set_shifted(uint32_t timer_peripheral, uint32_t channel,
+			     bool shifted)
+{
+	timer_set_oc_mode(timer_peripheral, channel,
+			  shifted ? TIM_OCM_PWM2 : TIM_OCM_PWM1);
+}
+
+void pwm_channel_set_shifted_duty(uint32_t timer_peripheral, uint32_t channel,
+				  uint16_t duty) {
+	timer_set_oc_value(timer_peripheral, channel,
+			   pwm_duty_to_compare(timer_peripheral, duty, true));
+}
+
+uint16_t pwm_duty_to_compare(uint32_t timer_peripheral, uint16_t duty,
+			     bool shifted)
+{
+	uint32_t period = TIM_ARR(timer_peripheral);
+
+	if (shifted) {
+		/* PWM2 is active above the compare value, which must clear the top */
+		if (!duty) {
+			return 0xffff;
+		} else if (duty == PWM_DUTY_FULL) {
+			return 0;
+		}
+
+		return period - ((period * duty) >> 16);
+	}
+
+	if (duty == PWM_DUTY_FULL) {
+		return period < 0xffff ? period + 1 : period;
+	}
+
+	return pwm_duty_to_count(timer_peripheral, duty);
 }
@@ -14,14 +14,53 @@
  * You should have received a copy of the GNU Lesser General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <stdbool.h>
 #include <stdint.h>
 
 void pwm_timer_init(uint32_t timer_peripheral, uint32_t frequency);
-void pwm_timer_set_freq(uint32_t timer_peripheral, uint32_t frequency);
+/*
+ * Both return the resulting number of duty steps per period. The hires
+ * version uses the full timer clock, doubling the resolution.
+ */
+uint32_t pwm_timer_set_freq(uint32_t timer_peripheral, uint32_t frequency);
+uint32_t pwm_timer_set_freq_hires(uint32_t timer_peripheral, uint32_t frequency);
 void pwm_timer_enable(uint32_t timer_peripheral);
 void pwm_timer_disable(uint32_t timer_peripheral);
+/*
+ * Switch between edge and centre-aligned counting. The timer must be
+ * disabled, and the frequency set again afterwards.
+ */
+void pwm_timer_set_centre_aligned(uint32_t timer_peripheral, bool centre);
+/* Load the preloaded prescaler, period and compare values immediately */
+void pwm_timer_reload(uint32_t timer_peripheral);
+/*
+ * Write a set of compare values so that they all take effect at the same
+ * update event. If an update is about to happen it's waited out, then
+ * they're written to the preload registers with interrupts masked. Update
+ * events are never held off, as that would also lose the TRGO which
+ * triggers the ADC.
+ */
+void pwm_timer_write_compare(uint32_t timer_peripheral, const uint32_t *channels,
+			     const uint16_t *values, unsigned int n);
 
 void pwm_channel_enable(uint32_t timer_peripheral, uint32_t channel);
 void pwm_channel_disable(uint32_t timer_peripheral, uint32_t channel);
+/* Held on for the whole period, rather than a 65535/65536 duty */
+#define PWM_DUTY_FULL 0xffff
+
 void pwm_channel_set_duty(uint32_t timer_peripheral, uint32_t channel,
 			  uint16_t duty);
+/* How many counts of the period a duty is on for */
+uint16_t pwm_duty_to_count(uint32_t timer_peripheral, uint16_t duty);
+/* The compare value for a duty, on a shifted channel or not */
+uint16_t pwm_duty_to_compare(uint32_t timer_peripheral, uint16_t duty,
+			     bool shifted);
+/*
+ * Centre the channel's pulse on the top of the count instead of the bottom.
+ * This is half a period out of phase with the other channels when
+ * centre-aligned. Use pwm_channel_set_shifted_duty() on shifted channels.
+ */
+void pwm_channel_set_shifted(uint32_t timer_peripheral, uint32_t channel,
+			     bool shifted);
+void pwm_channel_set_shifted_duty(uint32_t timer_peripheral, uint32_t channel,
+				  uint16_t duty);
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ramp.h"
+
+void ramp_set_limits(struct ramp *r, int32_t amax, int32_t jmax)
+{
+	r->amax = amax > 0 ? amax : 0;
+	r->jmax = jmax > 0 ? jmax : 0;
+	r->rate = 0;
+}
+
+bool ramp_enabled(struct ramp *r)
+{
+	return r->amax != 0;
+}
+
+void ramp_reset(struct ramp *r, int32_t value)
+{
+	r->target = r->value = value;
+	r->rate = 0;
+}
+
+void ramp_set_target(struct ramp *r, int32_t target)
+{
+	r->target = target;
+}
+
+int32_t ramp_tick(struct ramp *r)
+{
+	int64_t err = (int64_t)r->target - r->value;
+	int64_t a, brake;
+	int dir = 1;
+
+	if (!r->amax || !err) {
+		r->value = r->target;
+		r->rate = 0;
+		return r->value;
+	}
+
+	/* Work in the direction of the target, to keep the sums simple */
+	if (err < 0) {
+		dir = -1;
+		err = -err;
+	}
+	a = (int64_t)r->rate * dir;
+
+	if (!r->jmax) {
+		a = r->amax;
+	} else {
+		/* Change in value while bringing the rate back down to zero */
+		brake = a > 0 ? (a * a) / (2 * (int64_t)r->jmax) : 0;
+
+		if (brake >= err) {
+			a -= r->jmax;
+			if (a < r->jmax) {
+				/* Always creep forwards, or we'd never arrive */
+				a = r->jmax;
+			}
+		} else {
+			a += r->jmax;
+			if (a > r->amax) {
+				a = r->amax;
+			}
+		}
+	}
+
+	if (a >= err) {
+		r->value = r->target;
+		r->rate = 0;
+		return r->value;
+	}
+
+	r->value += a * dir;
+	r->rate = a * dir;
+
+	return r->value;
+}
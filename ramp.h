@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __RAMP_H__
+#define __RAMP_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Acceleration and jerk limited (S-curve) setpoint generator.
+ * Values are Q16.16 in arbitrary units, and limits are per tick (per
+ * tick^2 for jerk). ramp_tick() should be called once per control tick.
+ *
+ * An acceleration limit of 0 disables the ramp entirely, and a jerk limit
+ * of 0 gives a plain (trapezoidal) acceleration limited ramp.
+ */
+struct ramp {
+	int32_t target;
+	int32_t value;
+	int32_t rate;
+
+	int32_t amax;
+	int32_t jmax;
+};
+
+void ramp_set_limits(struct ramp *r, int32_t amax, int32_t jmax);
+bool ramp_enabled(struct ramp *r);
+void ramp_reset(struct ramp *r, int32_t value);
+void ramp_set_target(struct ramp *r, int32_t target);
+int32_t ramp_tick(struct ramp *r);
+
+#endif /* __RAMP_H__ */
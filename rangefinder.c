@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libopencm3/stm32/gpio.h>
+
+#include "i2c.h"
+#include "log.h"
+#include "rangefinder.h"
+#include "reflex.h"
+#include "systick.h"
+#include "vl53l0x.h"
+
+#define ARRAY_SIZE(_x) ((sizeof(_x) / sizeof(_x[0])))
+
+/* Each reading takes this long, which is also how often they arrive */
+#define RANGEFINDER_BUDGET_US 33000
+/* Don't hog the I2C bus (or the main loop) checking for readings */
+#define RANGEFINDER_POLL_MS 5
+
+/*
+ * All but one need XSHUT wired up so they can be given their own
+ * addresses. The index here is the bit in the reflex's sensor mask.
+ */
+static struct vl53l0x_dev rangefinders[] = {
+	{ .addr_7b = 0x30, .xshut_port = GPIOB, .xshut_pin = GPIO12 },
+	{ .addr_7b = 0x31, .xshut_port = GPIOB, .xshut_pin = GPIO13 },
+};
+
+_Static_assert(ARRAY_SIZE(rangefinders) <= REFLEX_MAX_RANGES,
+	       "More rangefinders than the reflex can take");
+
+static bool running;
+static uint32_t last_poll;
+
+static int rangefinder_start(struct vl53l0x_dev *dev)
+{
+	int ret;
+
+	ret = vl53l0x_set_measurement_mode(dev, VL53L0X_DEVICEMODE_CONTINUOUS_RANGING);
+	if (ret) {
+		return ret;
+	}
+
+	ret = vl53l0x_set_measurement_time(dev, RANGEFINDER_BUDGET_US);
+	if (ret) {
+		return ret;
+	}
+
+	return vl53l0x_start_measurement(dev);
+}
+
+int rangefinder_init(void)
+{
+	unsigned int i;
+	int ret;
+
+	i2c_init();
+
+	ret = vl53l0x_init_array(rangefinders, ARRAY_SIZE(rangefinders));
+	if (ret) {
+		log_err("Rangefinder init failed (%d)\n", ret);
+		return ret;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(rangefinders); i++) {
+		ret = rangefinder_start(&rangefinders[i]);
+		if (ret) {
+			log_err("Rangefinder %d start failed (%d)\n", i, ret);
+			return ret;
+		}
+	}
+
+	running = true;
+	last_poll = msTicks;
+
+	return 0;
+}
+
+void rangefinder_poll(void)
+{
+	VL53L0X_RangingMeasurementData_t data;
+	unsigned int i;
+
+	if (!running || msTicks - last_poll < RANGEFINDER_POLL_MS) {
+		return;
+	}
+	last_poll = msTicks;
+
+	for (i = 0; i < ARRAY_SIZE(rangefinders); i++) {
+		struct vl53l0x_dev *dev = &rangefinders[i];
+
+		if (vl53l0x_check_measurement_ready(dev) != 1) {
+			continue;
+		}
+
+		if (vl53l0x_get_measurement(dev, &data)) {
+			log_warn("Rangefinder %d read failed\n", i);
+			continue;
+		}
+
+		/* Anything else is out of range, or not to be trusted */
+		if (data.RangeStatus == 0) {
+			reflex_set_range(i, data.RangeMilliMeter);
+		}
+	}
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __RANGEFINDER_H__
+#define __RANGEFINDER_H__
+
+/*
+ * The on-board VL53L0X rangefinders, ranging continuously. Their readings
+ * go straight to the collision reflex, indexed by their position in the
+ * table in rangefinder.c.
+ */
+
+/* Returns 0 on success. The reflex only gets REFLEX_RANGE readings if not */
+int rangefinder_init(void);
+/* Call from the main loop, it collects any new readings */
+void rangefinder_poll(void);
+
+#endif /* __RANGEFINDER_H__ */
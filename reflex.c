@@ -0,0 +1,347 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "drive.h"
+#include "log.h"
+#include "motor.h"
+#include "reflex.h"
+#include "seqlock.h"
+#include "spi.h"
+#include "systick.h"
+
+/* Readings older than this are ignored */
+#define REFLEX_MAX_AGE_MS 250
+
+struct reflex_range {
+	uint16_t mm;
+	uint32_t timestamp;
+	bool valid;
+};
+
+struct reflex_config {
+	bool enabled;
+	uint8_t sensors;       /* Bit per rangefinder facing forwards */
+	uint16_t margin;       /* mm to leave after stopping */
+	uint32_t decel;        /* mm/s^2 the robot can be relied on to brake at */
+	uint16_t latency;      /* ms between a reading and it taking effect */
+};
+
+enum reflex_state {
+	REFLEX_DISABLED = 0,
+	REFLEX_CLEAR,
+	/* Forward speed is being limited */
+	REFLEX_LIMITING,
+	/* Too close to move forwards at all */
+	REFLEX_STOPPED,
+};
+
+static struct reflex {
+	/*
+	 * Written from the main loop. The control tick can interrupt that,
+	 * so it only tries once to read them and otherwise carries on with
+	 * its last copy.
+	 */
+	struct seqlock lock;
+	struct reflex_config cfg;
+	struct reflex_range ranges[REFLEX_MAX_RANGES];
+	/* Ranges from REFLEX_RANGE hide the on-board ones until this */
+	uint32_t override[REFLEX_MAX_RANGES];
+	uint8_t overridden;
+
+	/* The control tick's copies */
+	struct reflex_config active;
+	struct reflex_range seen[REFLEX_MAX_RANGES];
+
+	/* Only written by the control tick */
+	struct seqlock status_lock;
+	enum reflex_state state;
+	uint8_t nearest;
+	uint16_t range;
+	int32_t limit;         /* mm/s, -1 for none */
+} reflex = {
+	.limit = -1,
+};
+
+static uint32_t reflex_isqrt(uint64_t v)
+{
+	uint64_t res = 0, bit = (uint64_t)1 << 62;
+
+	while (bit > v)
+		bit >>= 2;
+
+	while (bit) {
+		if (v >= res + bit) {
+			v -= res + bit;
+			res = (res >> 1) + bit;
+		} else {
+			res >>= 1;
+		}
+		bit >>= 2;
+	}
+
+	return res;
+}
+
+/*
+ * Fastest speed (mm/s) which can stop within 'dist' mm, allowing for
+ * travelling at that speed for 'latency' ms first:
+ *   v * t + v^2 / 2a = d  =>  v = sqrt((a t)^2 + 2 a d) - a t
+ */
+static int32_t reflex_stop_speed(uint32_t dist, uint32_t latency)
+{
+	uint64_t at = ((uint64_t)reflex.active.decel * latency) / 1000;
+
+	return reflex_isqrt(at * at + 2 * (uint64_t)reflex.active.decel * dist) - at;
+}
+
+static void reflex_write_range(unsigned int idx, uint16_t mm)
+{
+	seqlock_write_begin(&reflex.lock);
+	reflex.ranges[idx].mm = mm;
+	reflex.ranges[idx].timestamp = msTicks;
+	reflex.ranges[idx].valid = true;
+	seqlock_write_end(&reflex.lock);
+}
+
+void reflex_set_range(unsigned int idx, uint16_t mm)
+{
+	if (idx >= REFLEX_MAX_RANGES) {
+		return;
+	}
+
+	if (reflex.overridden & (1 << idx)) {
+		if (msTicks - reflex.override[idx] <= REFLEX_MAX_AGE_MS)
+			return;
+		reflex.overridden &= ~(1 << idx);
+	}
+
+	reflex_write_range(idx, mm);
+}
+
+static void reflex_override_range(unsigned int idx, uint16_t mm)
+{
+	reflex.override[idx] = msTicks;
+	reflex.overridden |= (1 << idx);
+	reflex_write_range(idx, mm);
+}
+
+static void reflex_read_shared(void)
+{
+	struct reflex_range ranges[REFLEX_MAX_RANGES];
+	struct reflex_config cfg;
+	uint32_t seq;
+	unsigned int i;
+
+	seq = seqlock_read_begin(&reflex.lock);
+	cfg = reflex.cfg;
+	for (i = 0; i < REFLEX_MAX_RANGES; i++) {
+		ranges[i] = reflex.ranges[i];
+	}
+	if (seqlock_read_retry(&reflex.lock, seq))
+		return;
+
+	reflex.active = cfg;
+	for (i = 0; i < REFLEX_MAX_RANGES; i++) {
+		reflex.seen[i] = ranges[i];
+	}
+}
+
+struct reflex_status {
+	uint8_t state;
+	uint8_t nearest;
+	uint16_t range;        /* mm */
+	int32_t limit;         /* mm/s, -1 for none */
+	uint32_t timestamp;
+};
+
+/* Safe from anywhere at or below the control tick */
+static void reflex_fill_status(struct reflex_status *status)
+{
+	uint32_t seq;
+
+	do {
+		seq = seqlock_read_begin(&reflex.status_lock);
+		status->state = reflex.state;
+		status->nearest = reflex.nearest;
+		status->range = reflex.range;
+		status->limit = reflex.limit;
+	} while (seqlock_read_retry(&reflex.status_lock, seq));
+	status->timestamp = msTicks;
+}
+
+static void reflex_send_event(void);
+
+static void reflex_set_state(enum reflex_state state, uint8_t nearest,
+			     uint16_t range, int32_t limit)
+{
+	int32_t counts = limit < 0 ? -1 : drive_mm_to_counts(limit);
+	bool changed = state != reflex.state;
+
+	motor_limit_forward(counts);
+
+	seqlock_write_begin(&reflex.status_lock);
+	reflex.state = state;
+	reflex.nearest = nearest;
+	reflex.range = range;
+	reflex.limit = limit;
+	seqlock_write_end(&reflex.status_lock);
+
+	if (changed) {
+		reflex_send_event();
+	}
+}
+
+void reflex_tick(void)
+{
+	uint32_t now = msTicks;
+	uint16_t range = UINT16_MAX;
+	uint8_t nearest = 0;
+	uint32_t age = 0;
+	int32_t limit;
+	unsigned int i;
+
+	reflex_read_shared();
+	if (!reflex.active.enabled) {
+		if (reflex.state != REFLEX_DISABLED) {
+			reflex_set_state(REFLEX_DISABLED, 0, UINT16_MAX, -1);
+		}
+		return;
+	}
+
+	for (i = 0; i < REFLEX_MAX_RANGES; i++) {
+		struct reflex_range *r = &reflex.seen[i];
+
+		if (!(reflex.active.sensors & (1 << i)) || !r->valid ||
+		    now - r->timestamp > REFLEX_MAX_AGE_MS)
+			continue;
+
+		if (r->mm < range) {
+			range = r->mm;
+			nearest = i;
+			age = now - r->timestamp;
+		}
+	}
+
+	if (range == UINT16_MAX) {
+		reflex_set_state(REFLEX_CLEAR, nearest, range, -1);
+		return;
+	}
+
+	if (range <= reflex.active.margin) {
+		reflex_set_state(REFLEX_STOPPED, nearest, range, 0);
+		return;
+	}
+
+	limit = reflex_stop_speed(range - reflex.active.margin,
+				  reflex.active.latency + age);
+	reflex_set_state(limit ? REFLEX_LIMITING : REFLEX_STOPPED,
+			 nearest, range, limit);
+}
+
+enum reflex_type {
+	REFLEX_CONFIG = 0,
+	REFLEX_RANGE = 1,
+	REFLEX_STATUS = 2,
+};
+
+struct reflex_cmd_config {
+	uint8_t enable;
+	uint8_t sensors;
+	uint16_t margin;
+	uint32_t decel;
+	uint16_t latency;
+};
+
+/*
+ * Readings for the rangefinders with their bit set in 'valid'. These take
+ * the place of the on-board readings until they are older than
+ * REFLEX_MAX_AGE_MS, e.g. for testing, or sensors the board can't see.
+ */
+struct reflex_cmd_range {
+	uint8_t valid;
+	uint8_t pad;
+	uint16_t mm[REFLEX_MAX_RANGES];
+};
+
+struct reflex_cmd {
+	enum reflex_type type;
+	union {
+		/* type == REFLEX_CONFIG */
+		struct reflex_cmd_config config;
+		/* type == REFLEX_RANGE */
+		struct reflex_cmd_range range;
+		/* Returned for all types */
+		struct reflex_status status;
+	} payloads;
+};
+
+static void reflex_send_event(void)
+{
+	struct spi_pl_packet *pkt = spi_alloc_packet();
+	if (pkt) {
+		struct reflex_cmd *cmd = (struct reflex_cmd *)pkt->data;
+		pkt->type = EP_REFLEX;
+		cmd->type = REFLEX_STATUS;
+		reflex_fill_status(&cmd->payloads.status);
+
+		spi_send_packet(pkt);
+	}
+}
+
+static void reflex_configure(struct reflex_cmd_config *cfg)
+{
+	if (cfg->enable && (!cfg->decel || !cfg->sensors)) {
+		log_err("Invalid reflex config\n");
+		return;
+	}
+
+	if (cfg->enable && drive_mm_to_counts(1) < 0) {
+		log_warn("Reflex needs the drive to be configured\n");
+		return;
+	}
+
+	/* The control tick picks it up, and updates the state, next tick */
+	seqlock_write_begin(&reflex.lock);
+	reflex.cfg.enabled = cfg->enable;
+	reflex.cfg.sensors = cfg->sensors;
+	reflex.cfg.margin = cfg->margin;
+	reflex.cfg.decel = cfg->decel;
+	reflex.cfg.latency = cfg->latency;
+	seqlock_write_end(&reflex.lock);
+}
+
+void reflex_process_packet(struct spi_pl_packet *pkt)
+{
+	struct reflex_cmd *cmd = (struct reflex_cmd *)pkt->data;
+	unsigned int i;
+
+	if ((pkt->type != EP_REFLEX) || (pkt->flags & SPI_FLAG_ERROR))
+		return;
+
+	if (cmd->type == REFLEX_CONFIG) {
+		reflex_configure(&cmd->payloads.config);
+	} else if (cmd->type == REFLEX_RANGE) {
+		for (i = 0; i < REFLEX_MAX_RANGES; i++) {
+			if (cmd->payloads.range.valid & (1 << i))
+				reflex_override_range(i, cmd->payloads.range.mm[i]);
+		}
+	}
+
+	reflex_fill_status(&cmd->payloads.status);
+}
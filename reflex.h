@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __REFLEX_H__
+#define __REFLEX_H__
+
+#include <stdint.h>
+
+#include "spi.h"
+
+/*
+ * Collision reflex. Given the latest rangefinder readings, the forward
+ * speed is limited every control tick so that the robot can always stop
+ * short of the nearest obstacle, without waiting for the host.
+ *
+ * Every packet sent to EP_REFLEX is returned with the status filled in,
+ * and the status is also sent whenever the reflex state changes.
+ */
+#define EP_REFLEX 25
+
+#define REFLEX_MAX_RANGES 4
+
+/*
+ * A reading from on-board rangefinder idx, in mm. Only call it from the
+ * main loop.
+ */
+void reflex_set_range(unsigned int idx, uint16_t mm);
+/* Called from the control tick, before the motors */
+void reflex_tick(void);
+void reflex_process_packet(struct spi_pl_packet *pkt);
+
+#endif /* __REFLEX_H__ */
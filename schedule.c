@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "log.h"
+#include "schedule.h"
+#include "spi.h"
+
+#define SCHEDULE_LEN 8
+
+/*
+ * The wrapped command can be at most 24 bytes, which is enough for
+ * everything except MOTOR_POSITION.
+ */
+struct schedule_cmd {
+	uint32_t apply_at;
+	uint8_t type;
+	uint8_t pad[3];
+	uint8_t data[SPI_PACKET_DATA_LEN - 8];
+};
+
+/* A slot is free when pkt is NULL. Only the control tick frees slots */
+struct schedule_slot {
+	struct spi_pl_packet *volatile pkt;
+	uint32_t time;
+};
+
+static struct schedule_slot slots[SCHEDULE_LEN];
+static void (*schedule_apply)(struct spi_pl_packet *pkt);
+
+void schedule_init(void (*apply)(struct spi_pl_packet *pkt))
+{
+	schedule_apply = apply;
+}
+
+bool schedule_process_packet(struct spi_pl_packet *pkt)
+{
+	struct schedule_cmd *cmd = (struct schedule_cmd *)pkt->data;
+	uint32_t time = cmd->apply_at;
+	uint8_t type = cmd->type;
+	unsigned int i;
+
+	if ((pkt->type != EP_SCHEDULE) || (pkt->flags & SPI_FLAG_ERROR))
+		return false;
+
+	for (i = 0; i < SCHEDULE_LEN; i++) {
+		if (!slots[i].pkt) {
+			break;
+		}
+	}
+
+	if (i == SCHEDULE_LEN) {
+		log_warn("Schedule full\n");
+		return false;
+	}
+
+	/* Unwrap, so the packet can be handled like any other */
+	memmove(pkt->data, cmd->data, sizeof(cmd->data));
+	memset(pkt->data + sizeof(cmd->data), 0, SPI_PACKET_DATA_LEN - sizeof(cmd->data));
+	pkt->type = type;
+
+	slots[i].time = time;
+	/* schedule_tick() takes a slot once pkt is set, so it has to be last */
+	__asm__ volatile("" ::: "memory");
+	slots[i].pkt = pkt;
+
+	return true;
+}
+
+void schedule_tick(uint32_t now)
+{
+	while (1) {
+		struct schedule_slot *next = NULL;
+		struct spi_pl_packet *pkt;
+		unsigned int i;
+
+		/* Apply everything that's due, oldest first */
+		for (i = 0; i < SCHEDULE_LEN; i++) {
+			struct schedule_slot *s = &slots[i];
+			if (!s->pkt || (int32_t)(s->time - now) > 0) {
+				continue;
+			}
+
+			if (!next || (int32_t)(s->time - next->time) < 0) {
+				next = s;
+			}
+		}
+
+		if (!next) {
+			return;
+		}
+
+		pkt = next->pkt;
+		if (schedule_apply) {
+			schedule_apply(pkt);
+		}
+		spi_free_packet(pkt);
+		next->pkt = NULL;
+	}
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __SCHEDULE_H__
+#define __SCHEDULE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "spi.h"
+
+/*
+ * Deferred commands. A packet sent to EP_SCHEDULE wraps another command,
+ * which is applied in the first control tick at or after its 'apply at'
+ * board time (msTicks, as returned by the time sync endpoint).
+ */
+#define EP_SCHEDULE 22
+
+/*
+ * apply will be called from the control tick interrupt, with the unwrapped
+ * packet. The packet is freed afterwards.
+ */
+void schedule_init(void (*apply)(struct spi_pl_packet *pkt));
+/* Returns true if the packet was queued, otherwise the caller must free it */
+bool schedule_process_packet(struct spi_pl_packet *pkt);
+/* Call once per control tick, before anything else */
+void schedule_tick(uint32_t now);
+
+#endif /* __SCHEDULE_H__ */
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __SEQLOCK_H__
+#define __SEQLOCK_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Sequence lock, for reading a consistent copy of state which is updated
+ * from another context without masking interrupts.
+ *
+ * The writer bumps the sequence before and after updating, so it's odd
+ * while an update is in progress. Readers copy what they need, and retry if
+ * the sequence was odd or has changed:
+ *
+ *	do {
+ *		seq = seqlock_read_begin(&lock);
+ *		copy = state;
+ *	} while (seqlock_read_retry(&lock, seq));
+ *
+ * There must only be one writer at a time. A reader which can interrupt
+ * the writer would spin forever, so it must only make one attempt and keep
+ * whatever it had before if that fails.
+ *
+ * This is a single core with no cache, so a compiler barrier is all the
+ * ordering that's needed.
+ */
+struct seqlock {
+	volatile uint32_t seq;
+};
+
+#define SEQLOCK_BARRIER() __asm__ volatile("" ::: "memory")
+
+static inline void seqlock_init(struct seqlock *s)
+{
+	s->seq = 0;
+}
+
+static inline void seqlock_write_begin(struct seqlock *s)
+{
+	s->seq++;
+	SEQLOCK_BARRIER();
+}
+
+static inline void seqlock_write_end(struct seqlock *s)
+{
+	SEQLOCK_BARRIER();
+	s->seq++;
+}
+
+static inline uint32_t seqlock_read_begin(const struct seqlock *s)
+{
+	uint32_t seq = s->seq;
+
+	SEQLOCK_BARRIER();
+	return seq;
+}
+
+/* true if the copy taken since seqlock_read_begin() can't be used */
+static inline bool seqlock_read_retry(const struct seqlock *s, uint32_t seq)
+{
+	SEQLOCK_BARRIER();
+	return (seq & 1) || s->seq != seq;
+}
+
+#endif /* __SEQLOCK_H__ */
@@ -104,6 +104,14 @@ static void spi_add_last(struct spi_pl_packet_head *list, struct spi_pl_packet *
 	queue_enqueue(&(list->queue), (struct queue_node *)pkt);
 }
 
+static void spi_add_last_multi(struct spi_pl_packet_head *list,
+			       struct spi_pl_packet *first,
+			       struct spi_pl_packet *last)
+{
+	queue_enqueue_multi(&(list->queue), (struct queue_node *)first,
+			    (struct queue_node *)last);
+}
+
 static void spi_slave_init(uint32_t spidev)
 {
 	spi_reset(spidev);
@@ -292,17 +300,18 @@ void spi_slave_disable(uint32_t spidev)
 
 void spi_free_packet(struct spi_pl_packet *pkt)
 {
-	struct spi_pl_packet *tmp = pkt;
+	struct spi_pl_packet *tmp = pkt, *last = pkt;
 
 	if (!pkt)
 		return;
 
 	while (tmp) {
-		memset(&pkt->id, 0, sizeof(*pkt) - offsetof(struct spi_pl_packet, id));
+		memset(&tmp->id, 0, sizeof(*tmp) - offsetof(struct spi_pl_packet, id));
+		last = tmp;
 		tmp = (struct spi_pl_packet *)tmp->next;
 	}
 
-	spi_add_last(&packet_free, pkt);
+	spi_add_last_multi(&packet_free, pkt, last);
 }
 
 struct spi_pl_packet *spi_alloc_packet(void)
@@ -323,7 +332,14 @@ struct spi_pl_packet *spi_receive_packet(void)
 
 void spi_send_packet(struct spi_pl_packet *pkt)
 {
-	spi_add_last(&packet_outbox, pkt);
+	struct spi_pl_packet *last = pkt;
+
+	/* Multi-part packets go out together */
+	while (last->next) {
+		last = (struct spi_pl_packet *)last->next;
+	}
+
+	spi_add_last_multi(&packet_outbox, pkt, last);
 }
 
 static void spi_init_dma(void)
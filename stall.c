@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stall.h"
+
+/* Number of expected edge times without an edge which make a stall */
+#define STALL_TIMEOUT_MULT 4
+
+void stall_configure(struct stall *s, uint16_t duty, uint16_t min_ticks,
+		     uint16_t backoff, uint16_t fault_ticks)
+{
+	s->duty = duty;
+	s->min_ticks = min_ticks;
+	s->backoff = backoff;
+	s->fault_ticks = fault_ticks;
+
+	stall_clear(s);
+}
+
+void stall_clear(struct stall *s)
+{
+	s->state = STALL_OK;
+	s->ticks = 0;
+}
+
+enum stall_state stall_update(struct stall *s, bool moved, uint16_t duty,
+			      uint32_t timeout)
+{
+	if (!s->duty) {
+		stall_clear(s);
+		return s->state;
+	}
+
+	/* A fault stays until it's cleared */
+	if (s->state == STALL_FAULT) {
+		return s->state;
+	}
+
+	if (moved) {
+		stall_clear(s);
+		return s->state;
+	}
+
+	if (s->state == STALL_BACKOFF) {
+		if (++s->ticks > s->fault_ticks) {
+			s->state = STALL_FAULT;
+			s->n_faults++;
+		}
+		return s->state;
+	}
+
+	if (duty < s->duty) {
+		s->ticks = 0;
+		return s->state;
+	}
+
+	timeout *= STALL_TIMEOUT_MULT;
+	if (timeout < s->min_ticks) {
+		timeout = s->min_ticks;
+	} else if (timeout >= 0xffff) {
+		timeout = 0xfffe;
+	}
+
+	if (++s->ticks > timeout) {
+		s->state = STALL_BACKOFF;
+		s->ticks = 0;
+		s->n_stalls++;
+	}
+
+	return s->state;
+}
+
+uint16_t stall_limit(struct stall *s, uint16_t duty)
+{
+	switch (s->state) {
+	case STALL_BACKOFF:
+		return duty < s->backoff ? duty : s->backoff;
+	case STALL_FAULT:
+		return 0;
+	default:
+		return duty;
+	}
+}
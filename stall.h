@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __STALL_H__
+#define __STALL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Stall detection. A motor which doesn't move for long enough while the
+ * duty is high is stalled. The response is graded: first the duty is
+ * backed off, and if it still doesn't move the motor is turned off until
+ * the fault is cleared.
+ */
+enum stall_state {
+	STALL_OK = 0,
+	STALL_BACKOFF,
+	STALL_FAULT,
+};
+
+struct stall {
+	/* Set these with stall_configure() */
+	uint16_t duty;        /* Duty above which not moving is a stall, 0 disables */
+	uint16_t min_ticks;   /* Shortest timeout, control ticks */
+	uint16_t backoff;     /* Duty limit when backing off */
+	uint16_t fault_ticks; /* Time backing off before turning off */
+
+	/* These will be updated dynamically */
+	enum stall_state state;
+	uint16_t ticks;
+	uint16_t n_stalls;
+	uint16_t n_faults;
+};
+
+void stall_configure(struct stall *s, uint16_t duty, uint16_t min_ticks,
+		     uint16_t backoff, uint16_t fault_ticks);
+/* Clear the current state, but not the counters */
+void stall_clear(struct stall *s);
+/*
+ * Call once per control tick. timeout is how many ticks the motor should
+ * take to move at the current setpoint, a few of these are allowed before
+ * it's considered stalled.
+ */
+enum stall_state stall_update(struct stall *s, bool moved, uint16_t duty,
+			      uint32_t timeout);
+/* Limit duty according to the current state */
+uint16_t stall_limit(struct stall *s, uint16_t duty);
+
+#endif /* __STALL_H__ */
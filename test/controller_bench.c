@@ -0,0 +1,257 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Run each controller strategy against a first-order motor model, the way
+ * motor_tick() drives it, and report the tracking error, how much the duty
+ * chatters and the cost of controller_tick(). Host cycles are only good for comparing strategies,
+ * not for predicting the Cortex-M3.
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "controller.h"
+#include "observer.h"
+#include "test.h"
+
+/* One control tick, and the period counter's coarse unit, in seconds */
+#define TICK_S 0.0493
+#define UNIT_S 9.875e-6
+/* Period units per tick, as PID_TICK_PERIOD in motor.c */
+#define TICK_PERIOD 4993
+
+/* Motor: edges/s at full duty, the duty it starts to move at, time constant */
+#define PLANT_KV   2000.0
+#define PLANT_DMIN 2000.0
+#define PLANT_TAU  0.15
+/* Relative measurement noise */
+#define PLANT_NOISE 0.005
+
+/* The gain schedule from motor.c */
+static const struct gain gains[] = {
+	{ Q16(-130), 0, 0 },
+	{ Q16(-50), 0, 0 },
+	{ Q16(-10), 0, 0 },
+	{ Q16(-5), 0, 0 },
+	{ Q16(-2), 0, 0 },
+	{ Q16(-1), 0, 0 },
+};
+static const uint16_t gs_limits[] = { 100, 200, 400, 700, 800, 10000 };
+#define N_GAINS (sizeof(gains) / sizeof(gains[0]))
+
+static uint8_t gain_schedule(uint32_t point)
+{
+	uint8_t i;
+
+	for (i = 0; i < N_GAINS; i++) {
+		if (point <= gs_limits[i])
+			break;
+	}
+	return i;
+}
+
+/* Set point periods, each held for STEP_TICKS */
+static const uint32_t profile[] = { 2000, 800, 400, 1200, 600 };
+#define STEP_TICKS 120
+
+struct plant {
+	double w;      /* edges/s */
+	uint16_t duty;
+};
+
+static void plant_step(struct plant *p)
+{
+	double wss = PLANT_KV * (p->duty - PLANT_DMIN) / (65535 - PLANT_DMIN);
+
+	if (wss < 0)
+		wss = 0;
+	p->w += (wss - p->w) * (1 - exp(-TICK_S / PLANT_TAU));
+}
+
+/* Measured period, 0 if it's too slow to see an edge each tick */
+static uint32_t plant_period(struct plant *p)
+{
+	double w = p->w * (1 + PLANT_NOISE * test_noise(1000) / 1000.0);
+
+	if (w * TICK_S < 1)
+		return 0;
+	return 1 / (w * UNIT_S);
+}
+
+static inline uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+struct strategy {
+	const char *name;
+	enum controller_strategy strategy;
+	int32_t params[CONTROLLER_N_PARAMS];
+	/* Instead of the gain schedule, if set */
+	struct gain gain;
+	bool observer;
+};
+
+/* Duty for a period is Kff / period, with this plant */
+#define KFF ((int32_t)(65535 / (PLANT_KV * UNIT_S)))
+/* Fixed PID gains with a derivative term, as sent with MOTOR_GAINS */
+#define KC Q16(-5)
+#define KD Q16(-0.5)
+
+static const struct strategy strategies[] = {
+	{ "pid",          CONTROLLER_PID,      { 0, 0 },      { 0 },   false },
+	{ "pid+rate",     CONTROLLER_PID,      { 0, 0 },      { 0 },   true },
+	{ "pid-kd",       CONTROLLER_PID,      { 0, 0 },      { KC, KD, 0 }, false },
+	{ "pid-kd+rate",  CONTROLLER_PID,      { 0, 0 },      { KC, KD, 0 }, true },
+	{ "pi_ff",        CONTROLLER_PI_FF,    { KFF, 0 },    { 0 },   false },
+	{ "pi_ff+i",      CONTROLLER_PI_FF,    { KFF, Q16(-0.03) }, { 0 }, false },
+	{ "observer-raw", CONTROLLER_OBSERVER, { Q16(0.0004), Q16(0.0002) }, { 0 }, false },
+	{ "observer",     CONTROLLER_OBSERVER, { Q16(0.0004), Q16(0.0002) }, { 0 }, true },
+};
+
+struct result {
+	double mean_err;   /* mean |speed error| / target, % */
+	double ss_err;     /* the same, over the second half of each step */
+	double jitter;     /* mean |duty change| per tick, over the same */
+	double cycles;     /* per controller_tick() */
+};
+
+static void run(const struct strategy *s, struct result *r)
+{
+	struct controller c;
+	struct observer obs;
+	struct plant p = { 0, 0 };
+	uint64_t total_cycles = 0;
+	double err_sum = 0, ss_sum = 0, jit_sum = 0;
+	unsigned int step, i, n = 0, nss = 0;
+	uint32_t duty = 0, last_duty;
+
+	test_rand_state = 1;
+	memset(&c, 0, sizeof(c));
+	controller_init(&c, gains, N_GAINS);
+	controller_set_strategy(&c, s->strategy, s->params);
+	controller_set_gains(&c, s->gain.Kc, s->gain.Kd, s->gain.Ki);
+	observer_configure(&obs, Q15(0.5), Q15(0.15), 0);
+
+	for (step = 0; step < sizeof(profile) / sizeof(profile[0]); step++) {
+		uint32_t sp = profile[step];
+		double target = 1 / (sp * UNIT_S);
+
+		controller_set(&c, sp);
+		for (i = 0; i < STEP_TICKS; i++) {
+			uint32_t pv = plant_period(&p);
+			int32_t delta;
+			uint64_t t;
+
+			/* As motor_observe() */
+			if (s->observer) {
+				q16_t vel = pv ? ((int64_t)TICK_PERIOD << 16) / pv : 0;
+
+				observer_update(&obs, vel, duty);
+				vel = observer_get_velocity(&obs);
+				if (pv && vel > 0) {
+					controller_set_pv_rate(&c,
+						q_sat32(-((int64_t)pv * observer_get_accel(&obs)) / vel));
+					controller_set_pv_speed(&c,
+						q_sat32(((int64_t)vel << 16) / TICK_PERIOD));
+				}
+			}
+
+			t = cycles();
+			delta = controller_tick(&c, pv, gain_schedule((pv + sp) >> 1));
+			total_cycles += cycles() - t;
+
+			/* As motor_tick() */
+			last_duty = duty;
+			if (delta) {
+				if (delta < 0 && -delta > (int32_t)duty)
+					duty = 0;
+				else if (duty + delta > 0xffff)
+					duty = 0xffff;
+				else
+					duty += delta;
+				if (duty < 3000)
+					duty = 3000;
+			}
+			p.duty = duty;
+			plant_step(&p);
+
+			err_sum += fabs(p.w - target) / target;
+			n++;
+			if (i >= STEP_TICKS / 2) {
+				ss_sum += fabs(p.w - target) / target;
+				jit_sum += abs((int32_t)(duty - last_duty));
+				nss++;
+			}
+		}
+	}
+
+	r->mean_err = 100 * err_sum / n;
+	r->ss_err = 100 * ss_sum / nss;
+	r->jitter = jit_sum / nss;
+	r->cycles = (double)total_cycles / n;
+}
+
+/* What reading the counter itself costs, to take off the results */
+static double overhead(void)
+{
+	uint64_t best = UINT64_MAX;
+	unsigned int i;
+
+	for (i = 0; i < 10000; i++) {
+		uint64_t t = cycles();
+
+		t = cycles() - t;
+		if (t < best)
+			best = t;
+	}
+
+	return best;
+}
+
+int main(void)
+{
+	double base = overhead();
+	unsigned int i, rep;
+
+	printf("%-14s %10s %10s %10s %10s\n", "strategy", "mean err%", "ss err%",
+	       "jitter", "cycles");
+	for (i = 0; i < sizeof(strategies) / sizeof(strategies[0]); i++) {
+		struct result r, best = { 0, 0, 0, 0 };
+
+		/* Take the quickest of a few runs, to lose scheduling noise */
+		for (rep = 0; rep < 20; rep++) {
+			run(&strategies[i], &r);
+			if (!rep || r.cycles < best.cycles)
+				best = r;
+		}
+		printf("%-14s %10.2f %10.2f %10.1f %10.1f\n", strategies[i].name,
+		       best.mean_err, best.ss_err, best.jitter, best.cycles - base);
+	}
+
+	return 0;
+}
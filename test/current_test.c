@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Drive the current sense filter and limit loop from a simulated ADC sample
+ * stream, with a motor whose current is proportional to duty.
+ */
+#include <stdint.h>
+
+#include "fixed.h"
+#include "current.h"
+#include "test.h"
+
+/* The same scaling as motor.c: mA per ADC count */
+#define SCALE  Q16(0.806)
+#define SHIFT  2
+
+/* Motor current at full duty, mA */
+#define STALL_MA 2400
+/* ADC noise, counts */
+#define NOISE 8
+
+static uint16_t adc_sample(uint32_t ma, uint16_t offset)
+{
+	int32_t raw = offset + ((int64_t)ma << 16) / SCALE + test_noise(NOISE);
+
+	if (raw < 0)
+		return 0;
+	if (raw > 4095)
+		return 4095;
+	return raw;
+}
+
+static uint32_t plant_ma(uint16_t duty)
+{
+	return ((uint32_t)duty * STALL_MA) / 0xffff;
+}
+
+static void test_filter_settles(void)
+{
+	struct current_sense cs;
+	unsigned int i;
+
+	current_sense_init(&cs, SCALE, 0, SHIFT);
+	for (i = 0; i < 50; i++)
+		current_sense_update(&cs, adc_sample(1000, 0));
+	CHECK_RANGE(current_sense_get(&cs), 980, 1020);
+
+	/* And back down again */
+	for (i = 0; i < 50; i++)
+		current_sense_update(&cs, adc_sample(200, 0));
+	CHECK_RANGE(current_sense_get(&cs), 190, 210);
+}
+
+static void test_offset(void)
+{
+	struct current_sense cs;
+	unsigned int i;
+
+	current_sense_init(&cs, SCALE, 100, SHIFT);
+	for (i = 0; i < 50; i++)
+		current_sense_update(&cs, 50);
+	CHECK(current_sense_get(&cs) == 0);
+
+	for (i = 0; i < 50; i++)
+		current_sense_update(&cs, adc_sample(500, 100));
+	CHECK_RANGE(current_sense_get(&cs), 490, 510);
+}
+
+static void test_no_limit(void)
+{
+	struct current_sense cs;
+	unsigned int i;
+
+	current_sense_init(&cs, SCALE, 0, SHIFT);
+	for (i = 0; i < 50; i++) {
+		current_sense_update(&cs, adc_sample(STALL_MA, 0));
+		CHECK(current_limit_apply(&cs, 0xffff) == 0xffff);
+	}
+}
+
+/* Run the limit loop against the plant, returns the mean current at the end */
+static uint32_t run_limit(struct current_sense *cs, uint16_t demand,
+			  unsigned int ticks, uint32_t *peak, uint16_t *duty)
+{
+	uint64_t sum = 0;
+	unsigned int i, n = 0;
+	uint16_t out = *duty;
+
+	*peak = 0;
+	for (i = 0; i < ticks; i++) {
+		uint32_t ma = plant_ma(out);
+
+		current_sense_update(cs, adc_sample(ma, 0));
+		out = current_limit_apply(cs, demand);
+
+		if (i >= ticks / 2) {
+			sum += ma;
+			n++;
+			if (ma > *peak)
+				*peak = ma;
+		}
+	}
+	*duty = out;
+
+	return sum / n;
+}
+
+static void test_limit_loop(void)
+{
+	struct current_sense cs;
+	uint32_t mean, peak;
+	uint16_t duty = 0;
+
+	current_sense_init(&cs, SCALE, 0, SHIFT);
+	current_sense_set_limit(&cs, 1200);
+
+	/* Full demand is held at the limit */
+	mean = run_limit(&cs, 0xffff, 400, &peak, &duty);
+	printf("  limit 1200 mA: mean %u mA, peak %u mA, duty %u\n",
+	       mean, peak, duty);
+	CHECK_RANGE(mean, 1170, 1230);
+	CHECK(peak < 1300);
+
+	/* Demand under the limit passes through once the loop recovers */
+	mean = run_limit(&cs, 0x4000, 400, &peak, &duty);
+	CHECK(duty == 0x4000);
+	CHECK_RANGE(mean, plant_ma(0x4000) - 1, plant_ma(0x4000) + 1);
+
+	/* Lowering the limit pulls it back down */
+	current_sense_set_limit(&cs, 300);
+	mean = run_limit(&cs, 0xffff, 400, &peak, &duty);
+	printf("  limit 300 mA: mean %u mA, peak %u mA, duty %u\n",
+	       mean, peak, duty);
+	CHECK_RANGE(mean, 280, 320);
+}
+
+int main(void)
+{
+	test_filter_settles();
+	test_offset();
+	test_no_limit();
+	test_limit_loop();
+
+	return test_result("current");
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Check that duty changes made between hbridge_begin_update() and
+ * hbridge_commit_update() reach the outputs at the same update event, and
+ * that the timer never misses an update (which is TIM2's TRGO, and so the
+ * ADC trigger) while they're staged. Runs pwm.c and hbridge.c against a mock
+ * timer register file, which moves on as registers are accessed.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/timer.h>
+
+#include "hbridge.h"
+#include "mock_timer.h"
+#include "test.h"
+
+static struct hbridge hb = {
+	.timer = TIM2,
+	.port = GPIOA,
+	.pins = 0xf,
+	.nchannels = 2,
+	.channels = {
+		{ .ch1 = TIM_OC1, .ch2 = TIM_OC2 },
+		{ .ch1 = TIM_OC3, .ch2 = TIM_OC4 },
+	},
+};
+
+/* The outputs each update event is allowed to load */
+static uint16_t before[MOCK_N_CHANNELS], after[MOCK_N_CHANNELS];
+static unsigned int mixed;
+static bool checking;
+
+/* Update events should come at a steady rate, twice a period if centred */
+static uint64_t last_update;
+static uint32_t interval;
+static unsigned int irregular;
+
+static void check_update(struct mock_timer *t)
+{
+	if (checking && memcmp(t->active, before, sizeof(before)) &&
+	    memcmp(t->active, after, sizeof(after))) {
+		mixed++;
+	}
+
+	if (last_update && t->ticks - last_update != interval) {
+		irregular++;
+	}
+	last_update = t->ticks;
+}
+
+static void snapshot(uint16_t *dst)
+{
+	memcpy(dst, mock_timer(hb.timer)->ccr, sizeof(before));
+}
+
+static void set_both(uint16_t duty_a, enum direction dir_a,
+		     uint16_t duty_b, enum direction dir_b,
+		     uint32_t gap, bool staged)
+{
+	if (staged) {
+		hbridge_begin_update(&hb);
+	}
+
+	hbridge_set_duty(&hb, HBRIDGE_A, dir_a, duty_a);
+	/* The rest of the control tick, which may take a few periods */
+	mock_advance(hb.timer, gap);
+	hbridge_set_duty(&hb, HBRIDGE_B, dir_b, duty_b);
+
+	if (staged) {
+		hbridge_commit_update(&hb);
+	}
+}
+
+/*
+ * Start the update at every phase of the period, with gaps up to a few
+ * periods long, and check that each update event loads either all of the
+ * old values or all of the new ones.
+ */
+static unsigned int run(bool centre, bool staged)
+{
+	struct mock_timer *t = mock_timer(hb.timer);
+	struct hbridge saved;
+	uint32_t phase, gap;
+	unsigned int i = 0;
+
+	hbridge_init(&hb);
+	hbridge_set_centre_aligned(&hb, centre);
+	hbridge_set_duty(&hb, HBRIDGE_A, DIRECTION_FWD, 0x2000);
+	hbridge_set_duty(&hb, HBRIDGE_B, DIRECTION_FWD, 0x2000);
+
+	interval = centre ? t->arr : t->arr + 1;
+	mock_advance(hb.timer, 2 * interval);
+
+	mixed = 0;
+	irregular = 0;
+	last_update = 0;
+	checking = true;
+	t->on_update = check_update;
+
+	for (phase = 0; phase < interval; phase += 37) {
+		for (gap = 0; gap < 3 * interval; gap += interval / 3 + 11) {
+			uint16_t duty = 0x1000 + (i++ % 16) * 0xe00;
+			enum direction dir = i & 1 ? DIRECTION_FWD : DIRECTION_REV;
+
+			mock_advance(hb.timer, phase);
+
+			/* Work out what the new values will be, then do it */
+			snapshot(before);
+			saved = hb;
+			checking = false;
+			set_both(duty, dir, 0xffff - duty, !dir, 0, false);
+			snapshot(after);
+			hb = saved;
+			memcpy(t->ccr, before, sizeof(before));
+			checking = true;
+
+			set_both(duty, dir, 0xffff - duty, !dir, gap, staged);
+			mock_advance(hb.timer, interval);
+			CHECK(!memcmp(t->active, after, sizeof(after)));
+		}
+	}
+
+	CHECK(t->lost == 0);
+	CHECK(irregular == 0);
+	t->on_update = NULL;
+
+	return mixed;
+}
+
+int main(void)
+{
+	/* The check must be able to see a torn update */
+	CHECK(run(false, false) > 0);
+
+	CHECK(run(false, true) == 0);
+	CHECK(run(true, true) == 0);
+
+	/* Slower register access, nearer the real bus */
+	mock_step = 4;
+	CHECK(run(false, true) == 0);
+	CHECK(run(true, true) == 0);
+
+	return test_result("hbridge_test");
+}
@@ -0,0 +1,7 @@
+/* Host mock: there are no interrupts to mask */
+#ifndef __MOCK_LIBOPENCM3_CORTEX_H__
+#define __MOCK_LIBOPENCM3_CORTEX_H__
+
+#define CM_ATOMIC_CONTEXT() do { } while (0)
+
+#endif
@@ -0,0 +1,22 @@
+/* Host mock */
+#ifndef __MOCK_LIBOPENCM3_GPIO_H__
+#define __MOCK_LIBOPENCM3_GPIO_H__
+
+#include <stdint.h>
+
+#define GPIOA 1
+#define GPIOB 2
+#define GPIO_MODE_OUTPUT_50_MHZ 3
+#define GPIO_CNF_OUTPUT_ALTFN_PUSHPULL 2
+#define GPIO_TIM2_CH1_ETR (1 << 0)
+#define GPIO_TIM2_CH2 (1 << 1)
+#define GPIO_TIM2_CH3 (1 << 2)
+#define GPIO_TIM2_CH4 (1 << 3)
+
+static inline void gpio_set_mode(uint32_t port, uint8_t mode, uint8_t cnf,
+				 uint16_t pins)
+{
+	(void)port; (void)mode; (void)cnf; (void)pins;
+}
+
+#endif
@@ -0,0 +1 @@
+/* Host mock, nothing needed */
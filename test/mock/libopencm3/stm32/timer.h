@@ -0,0 +1,61 @@
+/* Host mock, see test/mock/mock_timer.h */
+#ifndef __MOCK_LIBOPENCM3_TIMER_H__
+#define __MOCK_LIBOPENCM3_TIMER_H__
+
+#include <stdint.h>
+
+#include "mock_timer.h"
+
+#define TIM1 1
+#define TIM2 2
+#define TIM3 3
+#define TIM4 4
+
+#define MOCK_CR1 0
+#define MOCK_PSC 1
+#define MOCK_ARR 2
+#define MOCK_CNT 3
+
+#define TIM_CR1(t) (*mock_reg((t), MOCK_CR1))
+#define TIM_PSC(t) (*mock_reg((t), MOCK_PSC))
+#define TIM_ARR(t) (*mock_reg((t), MOCK_ARR))
+#define TIM_CNT(t) (*mock_reg((t), MOCK_CNT))
+
+#define TIM_CR1_CEN           (1 << 0)
+#define TIM_CR1_UDIS          (1 << 1)
+#define TIM_CR1_DIR_UP        (0 << 4)
+#define TIM_CR1_DIR_DOWN      (1 << 4)
+#define TIM_CR1_CMS_EDGE      (0 << 5)
+#define TIM_CR1_CMS_CENTER_1  (1 << 5)
+#define TIM_CR1_CMS_MASK      (3 << 5)
+#define TIM_CR1_CKD_CK_INT    (0 << 8)
+
+#define TIM_SMCR_SMS_OFF 0
+#define TIM_EGR_UG (1 << 0)
+
+enum tim_oc_id { TIM_OC1 = 0, TIM_OC1N, TIM_OC2, TIM_OC2N, TIM_OC3, TIM_OC3N, TIM_OC4 };
+enum tim_oc_mode { TIM_OCM_FROZEN, TIM_OCM_PWM1, TIM_OCM_PWM2 };
+
+void timer_reset(uint32_t timer);
+void timer_set_prescaler(uint32_t timer, uint32_t value);
+void timer_set_period(uint32_t timer, uint32_t period);
+void timer_slave_set_mode(uint32_t timer, uint8_t mode);
+void timer_set_mode(uint32_t timer, uint32_t clock_div, uint32_t alignment,
+		    uint32_t direction);
+void timer_set_alignment(uint32_t timer, uint32_t alignment);
+void timer_enable_preload(uint32_t timer);
+void timer_update_on_overflow(uint32_t timer);
+void timer_enable_update_event(uint32_t timer);
+void timer_disable_update_event(uint32_t timer);
+void timer_generate_event(uint32_t timer, uint32_t event);
+void timer_enable_counter(uint32_t timer);
+void timer_disable_counter(uint32_t timer);
+void timer_enable_break_main_output(uint32_t timer);
+void timer_set_oc_mode(uint32_t timer, enum tim_oc_id oc, enum tim_oc_mode mode);
+void timer_set_oc_polarity_high(uint32_t timer, enum tim_oc_id oc);
+void timer_enable_oc_preload(uint32_t timer, enum tim_oc_id oc);
+void timer_enable_oc_output(uint32_t timer, enum tim_oc_id oc);
+void timer_disable_oc_output(uint32_t timer, enum tim_oc_id oc);
+void timer_set_oc_value(uint32_t timer, enum tim_oc_id oc, uint32_t value);
+
+#endif
@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+
+#include <libopencm3/stm32/timer.h>
+
+#include "mock_timer.h"
+
+struct mock_timer mock_timers[MOCK_N_TIMERS];
+uint32_t mock_step = 1;
+
+struct mock_timer *mock_timer(uint32_t timer)
+{
+	return &mock_timers[timer];
+}
+
+static void mock_update(struct mock_timer *t)
+{
+	if (t->udis) {
+		t->lost++;
+		return;
+	}
+
+	memcpy(t->active, t->ccr, sizeof(t->active));
+	t->updates++;
+	if (t->on_update) {
+		t->on_update(t);
+	}
+}
+
+static void mock_tick(struct mock_timer *t)
+{
+	if (!(t->cr1 & TIM_CR1_CEN)) {
+		return;
+	}
+	t->ticks++;
+
+	if (!(t->cr1 & TIM_CR1_CMS_MASK)) {
+		if (++t->cnt > t->arr) {
+			t->cnt = 0;
+			mock_update(t);
+		}
+		return;
+	}
+
+	/* Centre-aligned updates at both ends */
+	if (t->cr1 & TIM_CR1_DIR_DOWN) {
+		if (--t->cnt == 0) {
+			t->cr1 &= ~TIM_CR1_DIR_DOWN;
+			mock_update(t);
+		}
+	} else if (++t->cnt >= t->arr) {
+		t->cr1 |= TIM_CR1_DIR_DOWN;
+		mock_update(t);
+	}
+}
+
+void mock_advance(uint32_t timer, uint32_t counts)
+{
+	while (counts--) {
+		mock_tick(mock_timer(timer));
+	}
+}
+
+uint32_t *mock_reg(uint32_t timer, unsigned int offset)
+{
+	struct mock_timer *t = mock_timer(timer);
+
+	mock_advance(timer, mock_step);
+
+	switch (offset) {
+	case MOCK_CR1:
+		return &t->cr1;
+	case MOCK_PSC:
+		return &t->psc;
+	case MOCK_ARR:
+		return &t->arr;
+	default:
+		return &t->cnt;
+	}
+}
+
+void timer_reset(uint32_t timer)
+{
+	struct mock_timer *t = mock_timer(timer);
+
+	memset(t, 0, sizeof(*t));
+	t->arr = 0xffff;
+}
+
+void timer_set_prescaler(uint32_t timer, uint32_t value)
+{
+	TIM_PSC(timer) = value;
+}
+
+void timer_set_period(uint32_t timer, uint32_t period)
+{
+	TIM_ARR(timer) = period;
+}
+
+void timer_slave_set_mode(uint32_t timer, uint8_t mode)
+{
+	(void)timer;
+	(void)mode;
+}
+
+void timer_set_mode(uint32_t timer, uint32_t clock_div, uint32_t alignment,
+		    uint32_t direction)
+{
+	uint32_t cr1 = TIM_CR1(timer) & TIM_CR1_CEN;
+
+	TIM_CR1(timer) = cr1 | clock_div | alignment | direction;
+}
+
+void timer_set_alignment(uint32_t timer, uint32_t alignment)
+{
+	TIM_CR1(timer) = (TIM_CR1(timer) & ~TIM_CR1_CMS_MASK) | alignment;
+}
+
+void timer_enable_preload(uint32_t timer)
+{
+	(void)timer;
+}
+
+void timer_update_on_overflow(uint32_t timer)
+{
+	(void)timer;
+}
+
+void timer_enable_update_event(uint32_t timer)
+{
+	mock_advance(timer, mock_step);
+	mock_timer(timer)->udis = false;
+}
+
+void timer_disable_update_event(uint32_t timer)
+{
+	mock_advance(timer, mock_step);
+	mock_timer(timer)->udis = true;
+}
+
+void timer_generate_event(uint32_t timer, uint32_t event)
+{
+	struct mock_timer *t = mock_timer(timer);
+
+	mock_advance(timer, mock_step);
+	if (event & TIM_EGR_UG) {
+		t->cnt = 0;
+		t->cr1 &= ~TIM_CR1_DIR_DOWN;
+		mock_update(t);
+	}
+}
+
+void timer_enable_counter(uint32_t timer)
+{
+	TIM_CR1(timer) |= TIM_CR1_CEN;
+}
+
+void timer_disable_counter(uint32_t timer)
+{
+	TIM_CR1(timer) &= ~TIM_CR1_CEN;
+}
+
+void timer_enable_break_main_output(uint32_t timer)
+{
+	(void)timer;
+}
+
+/* OCxN share their compare register with OCx */
+static unsigned int mock_oc_index(enum tim_oc_id oc)
+{
+	return oc / 2;
+}
+
+void timer_set_oc_mode(uint32_t timer, enum tim_oc_id oc, enum tim_oc_mode mode)
+{
+	mock_advance(timer, mock_step);
+	mock_timer(timer)->ocm[mock_oc_index(oc)] = mode;
+}
+
+void timer_set_oc_polarity_high(uint32_t timer, enum tim_oc_id oc)
+{
+	(void)timer;
+	(void)oc;
+}
+
+void timer_enable_oc_preload(uint32_t timer, enum tim_oc_id oc)
+{
+	(void)timer;
+	(void)oc;
+}
+
+void timer_enable_oc_output(uint32_t timer, enum tim_oc_id oc)
+{
+	(void)timer;
+	(void)oc;
+}
+
+void timer_disable_oc_output(uint32_t timer, enum tim_oc_id oc)
+{
+	(void)timer;
+	(void)oc;
+}
+
+void timer_set_oc_value(uint32_t timer, enum tim_oc_id oc, uint32_t value)
+{
+	mock_advance(timer, mock_step);
+	mock_timer(timer)->ccr[mock_oc_index(oc)] = value;
+}
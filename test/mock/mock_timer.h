@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __MOCK_TIMER_H__
+#define __MOCK_TIMER_H__
+
+/*
+ * A register-level model of the STM32 general purpose timers, enough for
+ * pwm.c and hbridge.c. Every register access moves the counter on by
+ * mock_step counts, so time passes while code runs. Compare values are
+ * written to preload registers, and copied to the active ones by update
+ * events, like OCxPE.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MOCK_N_TIMERS 5
+#define MOCK_N_CHANNELS 4
+
+struct mock_timer {
+	uint32_t cr1, psc, arr, cnt;
+	uint16_t ccr[MOCK_N_CHANNELS];
+	uint16_t active[MOCK_N_CHANNELS];
+	uint32_t ocm[MOCK_N_CHANNELS];
+	bool udis;
+	/* Timer clocks since reset */
+	uint64_t ticks;
+
+	/* Update events which did or didn't happen (UDIS) at a wrap */
+	unsigned int updates;
+	unsigned int lost;
+	void (*on_update)(struct mock_timer *t);
+};
+
+extern struct mock_timer mock_timers[MOCK_N_TIMERS];
+extern uint32_t mock_step;
+
+struct mock_timer *mock_timer(uint32_t timer);
+/* Run the counter on, as if some code had taken a while */
+void mock_advance(uint32_t timer, uint32_t counts);
+uint32_t *mock_reg(uint32_t timer, unsigned int offset);
+
+#endif /* __MOCK_TIMER_H__ */
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Minimal helpers for the host tests. A failed check prints where it was and
+ * carries on, main() returns test_result() so the run fails at the end.
+ */
+#ifndef __TEST_H__
+#define __TEST_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+static int test_failures;
+
+#define CHECK(_cond) do { \
+	if (!(_cond)) { \
+		printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #_cond); \
+		test_failures++; \
+	} \
+} while (0)
+
+#define CHECK_RANGE(_v, _lo, _hi) do { \
+	long long __v = (_v); \
+	if (__v < (long long)(_lo) || __v > (long long)(_hi)) { \
+		printf("%s:%d: %s = %lld, not in [%lld, %lld]\n", __FILE__, \
+		       __LINE__, #_v, __v, (long long)(_lo), (long long)(_hi)); \
+		test_failures++; \
+	} \
+} while (0)
+
+static inline int test_result(const char *name)
+{
+	printf("%s: %s\n", name, test_failures ? "FAIL" : "PASS");
+	return test_failures ? 1 : 0;
+}
+
+/* Repeatable noise, so runs are comparable */
+static uint32_t test_rand_state = 1;
+
+static inline int32_t test_noise(int32_t amplitude)
+{
+	test_rand_state = test_rand_state * 1103515245 + 12345;
+	if (!amplitude)
+		return 0;
+	return (int32_t)((test_rand_state >> 16) % (2 * amplitude + 1)) - amplitude;
+}
+
+#endif /* __TEST_H__ */
@@ -0,0 +1,402 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "log.h"
+#include "spi.h"
+#include "trace.h"
+
+/* 4 kB, shared out between samples depending on the signals selected */
+#define TRACE_WORDS 1024
+
+/* Bytes per read request, to leave some packets for everyone else */
+#define TRACE_READ_MAX (8 * SPI_PACKET_DATA_LEN)
+
+#define TRACE_ALL_SIGNALS ((1 << TRACE_N_SIGNALS) - 1)
+
+enum trace_state {
+	TRACE_RUNNING = 0,
+	TRACE_FROZEN,
+	/* Recording, waiting for the trigger */
+	TRACE_ARMED,
+	/* Recording the post-trigger samples */
+	TRACE_TRIGGERED,
+};
+
+enum trace_trigger {
+	TRACE_TRIG_MANUAL = 0,
+	TRACE_TRIG_SETPOINT,
+	/* |err| > threshold */
+	TRACE_TRIG_ERROR,
+	TRACE_TRIG_STALL,
+};
+
+static struct trace {
+	volatile enum trace_state state;
+	/* Bit per motor channel */
+	uint8_t mask;
+	/* Bit per enum trace_signal */
+	uint16_t signals;
+	/* Words per sample, including the header */
+	uint8_t words;
+	/* Samples which fit in buf */
+	uint16_t capacity;
+	/* Next sample slot, and the number of valid samples before it */
+	uint16_t head;
+	uint16_t count;
+
+	enum trace_trigger trigger;
+	uint8_t trig_channel;
+	int32_t threshold;
+	uint16_t pre, post;
+	uint16_t remaining;
+	bool triggered;
+	uint32_t last_setpoint;
+	bool last_valid;
+
+	uint32_t buf[TRACE_WORDS];
+} trace;
+
+static int32_t trace_signal_value(const struct trace_sample *s,
+				  enum trace_signal sig)
+{
+	switch (sig) {
+	case TRACE_SIG_SETPOINT:
+		return s->setpoint;
+	case TRACE_SIG_PERIOD:
+		return s->period;
+	case TRACE_SIG_ERR:
+		return s->err;
+	case TRACE_SIG_IERR:
+		return s->ierr;
+	case TRACE_SIG_P:
+		return s->p;
+	case TRACE_SIG_I:
+		return s->i;
+	case TRACE_SIG_D:
+		return s->d;
+	case TRACE_SIG_DUTY:
+		return s->duty;
+	case TRACE_SIG_GS_IDX:
+		return s->gs_idx;
+	case TRACE_SIG_STALL:
+		return s->stall;
+	case TRACE_SIG_VEL:
+		return s->vel;
+	case TRACE_SIG_ACCEL:
+		return s->accel;
+	case TRACE_SIG_CYCLES:
+		return s->cycles;
+	default:
+		return 0;
+	}
+}
+
+static void trace_setup(uint8_t mask, uint16_t signals)
+{
+	unsigned int i;
+
+	trace.state = TRACE_FROZEN;
+
+	if (!signals)
+		signals = TRACE_ALL_SIGNALS;
+
+	trace.mask = mask;
+	trace.signals = signals & TRACE_ALL_SIGNALS;
+	trace.words = 1;
+	for (i = 0; i < TRACE_N_SIGNALS; i++) {
+		if (trace.signals & (1 << i))
+			trace.words++;
+	}
+	trace.capacity = TRACE_WORDS / trace.words;
+	trace.head = 0;
+	trace.count = 0;
+	trace.last_valid = false;
+	trace.triggered = false;
+}
+
+static bool trace_check_trigger(const struct trace_sample *s)
+{
+	bool ret = false;
+
+	if (s->channel != trace.trig_channel)
+		return false;
+
+	switch (trace.trigger) {
+	case TRACE_TRIG_MANUAL:
+		ret = trace.triggered;
+		break;
+	case TRACE_TRIG_SETPOINT:
+		ret = trace.last_valid && s->setpoint != trace.last_setpoint;
+		break;
+	case TRACE_TRIG_ERROR:
+		ret = s->err > trace.threshold || s->err < -trace.threshold;
+		break;
+	case TRACE_TRIG_STALL:
+		ret = s->stall != 0;
+		break;
+	}
+
+	trace.last_setpoint = s->setpoint;
+	trace.last_valid = true;
+
+	return ret;
+}
+
+static void trace_send_status(void);
+
+void trace_record(const struct trace_sample *sample)
+{
+	uint32_t *p;
+	unsigned int i;
+
+	if (trace.state == TRACE_FROZEN || !(trace.mask & (1 << sample->channel)))
+		return;
+
+	/*
+	 * Check every sample, so the setpoint trigger always compares with
+	 * the one before, but only trigger once there's a full pre-trigger
+	 * window.
+	 */
+	if (trace.state == TRACE_ARMED && trace_check_trigger(sample) &&
+	    trace.count >= trace.pre) {
+		trace.state = TRACE_TRIGGERED;
+		trace.remaining = trace.post;
+	}
+
+	if (trace.state == TRACE_TRIGGERED && !trace.remaining) {
+		trace.state = TRACE_FROZEN;
+		trace.count = trace.pre + trace.post;
+		trace_send_status();
+		return;
+	}
+
+	p = &trace.buf[trace.head * trace.words];
+	*p++ = (sample->timestamp << 8) | sample->channel;
+	for (i = 0; i < TRACE_N_SIGNALS; i++) {
+		if (trace.signals & (1 << i))
+			*p++ = trace_signal_value(sample, i);
+	}
+
+	if (++trace.head >= trace.capacity)
+		trace.head = 0;
+	if (trace.count < trace.capacity)
+		trace.count++;
+
+	if (trace.state == TRACE_TRIGGERED)
+		trace.remaining--;
+}
+
+enum trace_type {
+	TRACE_START = 0,
+	TRACE_FREEZE = 1,
+	TRACE_READ = 2,
+	TRACE_STATUS = 3,
+	TRACE_ARM = 4,
+	TRACE_TRIGGER = 5,
+};
+
+struct trace_cmd_start {
+	/* Bit per motor channel to record */
+	uint8_t mask;
+	uint8_t pad;
+	/* Bit per enum trace_signal, 0 for all of them */
+	uint16_t signals;
+};
+
+struct trace_cmd_arm {
+	uint8_t mask;
+	uint8_t pad;
+	uint16_t signals;
+	/* enum trace_trigger, and the motor channel it looks at */
+	uint8_t trigger;
+	uint8_t channel;
+	/* Samples to keep from before and after the trigger */
+	uint16_t pre;
+	uint16_t post;
+	uint16_t pad2;
+	/* For TRACE_TRIG_ERROR, must be > 0 */
+	int32_t threshold;
+};
+
+struct trace_cmd_read {
+	/* Index of the first sample, 0 is the oldest */
+	uint16_t first;
+	uint16_t count;
+};
+
+struct trace_status {
+	uint8_t state;
+	uint8_t mask;
+	uint16_t signals;
+	/* Words per sample */
+	uint8_t words;
+	uint8_t pad;
+	uint16_t count;
+	/* Samples following this, for TRACE_READ */
+	uint16_t first;
+	uint16_t nsamples;
+};
+
+struct trace_cmd {
+	enum trace_type type;
+	union {
+		/* type == TRACE_START */
+		struct trace_cmd_start start;
+		/* type == TRACE_ARM */
+		struct trace_cmd_arm arm;
+		/* type == TRACE_READ */
+		struct trace_cmd_read read;
+		/* Returned for all types */
+		struct trace_status status;
+	} payloads;
+};
+
+static void trace_fill_status(struct trace_status *status, uint16_t first,
+			      uint16_t nsamples)
+{
+	status->state = trace.state;
+	status->mask = trace.mask;
+	status->signals = trace.signals;
+	status->words = trace.words;
+	status->count = trace.count;
+	status->first = first;
+	status->nsamples = nsamples;
+}
+
+static void trace_send_status(void)
+{
+	struct spi_pl_packet *pkt = spi_alloc_packet();
+	if (pkt) {
+		struct trace_cmd *cmd = (struct trace_cmd *)pkt->data;
+		pkt->type = EP_TRACE;
+		cmd->type = TRACE_STATUS;
+		trace_fill_status(&cmd->payloads.status, 0, 0);
+
+		spi_send_packet(pkt);
+	}
+}
+
+/*
+ * Append the samples to pkt as a multi-part packet. Returns the number
+ * added, which is 0 if we ran out of packets.
+ */
+static uint16_t trace_read(struct spi_pl_packet *pkt, uint16_t first, uint16_t count)
+{
+	uint16_t oldest = (trace.head + trace.capacity - trace.count) % trace.capacity;
+	int offset = offsetof(struct trace_cmd, payloads) + sizeof(struct trace_status);
+	uint16_t max = TRACE_READ_MAX / (trace.words * sizeof(uint32_t));
+	uint16_t i;
+
+	if (first >= trace.count)
+		return 0;
+
+	if (count > max)
+		count = max;
+
+	if (count > trace.count - first)
+		count = trace.count - first;
+
+	for (i = 0; i < count; i++) {
+		uint16_t idx = (oldest + first + i) % trace.capacity;
+		uint32_t *s = &trace.buf[idx * trace.words];
+
+		offset = spi_packetise_stream(pkt, offset, (const char *)s,
+					      trace.words * sizeof(uint32_t));
+		if (offset < 0) {
+			log_warn("Trace read out of packets\n");
+			spi_free_packet((struct spi_pl_packet *)pkt->next);
+			pkt->next = NULL;
+			pkt->nparts = 0;
+			return 0;
+		}
+	}
+
+	return count;
+}
+
+static void trace_arm(struct trace_cmd_arm *arm)
+{
+	trace_setup(arm->mask, arm->signals);
+
+	if (arm->trigger > TRACE_TRIG_STALL ||
+	    !(trace.mask & (1 << arm->channel)) ||
+	    (uint32_t)arm->pre + arm->post > trace.capacity) {
+		log_err("Bad trace trigger (%d, %d + %d)\n", arm->trigger,
+			arm->pre, arm->post);
+		return;
+	}
+
+	/* Its negation has to fit, and 0 would trigger on any error */
+	if (arm->trigger == TRACE_TRIG_ERROR && arm->threshold <= 0) {
+		log_err("Bad trace threshold (%ld)\n", (long)arm->threshold);
+		return;
+	}
+
+	trace.trigger = arm->trigger;
+	trace.trig_channel = arm->channel;
+	trace.threshold = arm->threshold;
+	trace.pre = arm->pre;
+	trace.post = arm->post;
+	trace.state = TRACE_ARMED;
+}
+
+void trace_process_packet(struct spi_pl_packet *pkt)
+{
+	struct trace_cmd *cmd = (struct trace_cmd *)pkt->data;
+	uint16_t first = 0, nsamples = 0;
+
+	if ((pkt->type != EP_TRACE) || (pkt->flags & SPI_FLAG_ERROR))
+		return;
+
+	switch (cmd->type) {
+	case TRACE_START:
+		trace_setup(cmd->payloads.start.mask, cmd->payloads.start.signals);
+		trace.state = TRACE_RUNNING;
+		break;
+	case TRACE_ARM:
+		trace_arm(&cmd->payloads.arm);
+		break;
+	case TRACE_TRIGGER:
+		trace.triggered = true;
+		break;
+	case TRACE_FREEZE:
+		trace.state = TRACE_FROZEN;
+		break;
+	case TRACE_READ:
+		first = cmd->payloads.read.first;
+		if (trace.state != TRACE_FROZEN) {
+			log_warn("Trace must be frozen to read\n");
+			break;
+		}
+		nsamples = trace_read(pkt, first, cmd->payloads.read.count);
+		break;
+	default:
+		break;
+	}
+
+	trace_fill_status(&cmd->payloads.status, first, nsamples);
+}
+
+void trace_init(void)
+{
+	trace_setup(0xff, TRACE_ALL_SIGNALS);
+	trace.state = TRACE_RUNNING;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+#include "spi.h"
+
+/*
+ * RAM trace of the control loop internals, recorded every control tick.
+ *
+ * It can run continuously until it's frozen, or be armed like a scope
+ * to capture a window around a trigger. Either way nothing is sent until
+ * the capture is over, then it can be read out in multi-part packets.
+ * Every packet sent to EP_TRACE is returned with the trace status filled
+ * in, and read requests have the samples appended. A status packet is
+ * also sent when a triggered capture completes.
+ */
+#define EP_TRACE 24
+
+struct trace_sample {
+	uint32_t timestamp;
+	uint8_t channel;
+	uint8_t gs_idx;
+	uint16_t duty;
+	uint32_t setpoint;
+	uint32_t period;
+	int32_t err;
+	int32_t ierr;
+	/* PID terms, duty per tick, saturated to 16 bits */
+	int16_t p, i, d;
+	uint8_t stall;
+	uint8_t pad;
+	/* Observer estimates, Q16.16 counts per tick (per tick) */
+	int32_t vel;
+	int32_t accel;
+	/* CPU cycles spent in controller_tick() */
+	uint32_t cycles;
+};
+
+/*
+ * Signals which can be recorded. Each is stored as 32 bits, after a
+ * header word of (timestamp ms << 8) | channel.
+ */
+enum trace_signal {
+	TRACE_SIG_SETPOINT = 0,
+	TRACE_SIG_PERIOD,
+	TRACE_SIG_ERR,
+	TRACE_SIG_IERR,
+	TRACE_SIG_P,
+	TRACE_SIG_I,
+	TRACE_SIG_D,
+	TRACE_SIG_DUTY,
+	TRACE_SIG_GS_IDX,
+	TRACE_SIG_STALL,
+	TRACE_SIG_VEL,
+	TRACE_SIG_ACCEL,
+	TRACE_SIG_CYCLES,
+	TRACE_N_SIGNALS,
+};
+
+void trace_init(void);
+/* Called from the control tick */
+void trace_record(const struct trace_sample *sample);
+/* Fills in pkt with the status (and samples). The caller should send it back */
+void trace_process_packet(struct spi_pl_packet *pkt);
+
+#endif /* __TRACE_H__ */
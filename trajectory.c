@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "drive.h"
+#include "log.h"
+#include "motor.h"
+#include "spi.h"
+#include "systick.h"
+#include "trajectory.h"
+
+/* Must be a power of two */
+#define TRAJECTORY_LEN 32
+
+/* A sample this far (ms) behind its timestamp is counted as late */
+#define TRAJECTORY_LATE_MS 50
+
+enum traj_kind {
+	/* a, b: Left and right wheel velocity, counts/s */
+	TRAJ_WHEELS = 0,
+	/* a, b: Linear (mm/s) and angular (mrad/s) velocity */
+	TRAJ_DRIVE = 1,
+};
+
+struct traj_sample {
+	uint32_t time;
+	int32_t a;
+	int32_t b;
+};
+
+struct traj_entry {
+	struct traj_sample sample;
+	enum traj_kind kind;
+};
+
+struct trajectory {
+	struct traj_entry buf[TRAJECTORY_LEN];
+	/* head is only written by the producer, tail by the consumer */
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	volatile bool flush;
+
+	bool moving;
+	bool underrun;
+
+	uint32_t n_underruns;
+	uint32_t n_late;
+	uint32_t last_time;
+};
+
+static struct trajectory traj;
+
+static uint32_t trajectory_count(void)
+{
+	return traj.head - traj.tail;
+}
+
+static void trajectory_apply(struct traj_entry *e)
+{
+	struct traj_sample *s = &e->sample;
+
+	switch (e->kind) {
+	case TRAJ_WHEELS:
+		motor_request_velocity(MOTOR_A, s->a);
+		motor_request_velocity(MOTOR_B, s->b);
+		break;
+	case TRAJ_DRIVE:
+		drive_set(s->a, s->b);
+		break;
+	}
+
+	traj.moving = s->a || s->b;
+	traj.last_time = s->time;
+}
+
+void trajectory_tick(uint32_t now)
+{
+	struct traj_entry *latest = NULL;
+
+	if (traj.flush) {
+		traj.tail = traj.head;
+		traj.flush = false;
+	}
+
+	/* Consume everything which is due, and apply the newest */
+	while (traj.tail != traj.head) {
+		struct traj_entry *e = &traj.buf[traj.tail & (TRAJECTORY_LEN - 1)];
+
+		if ((int32_t)(e->sample.time - now) > 0) {
+			break;
+		}
+
+		if (now - e->sample.time >= TRAJECTORY_LATE_MS) {
+			traj.n_late++;
+		}
+
+		latest = e;
+		traj.tail++;
+	}
+
+	if (latest) {
+		trajectory_apply(latest);
+		traj.underrun = false;
+	} else if (traj.moving && traj.tail == traj.head && !traj.underrun) {
+		/*
+		 * Ran dry while moving, the last setpoint is held until the
+		 * host catches up.
+		 */
+		traj.n_underruns++;
+		traj.underrun = true;
+	}
+}
+
+enum traj_type {
+	TRAJ_APPEND = 0,
+	TRAJ_CLEAR = 1,
+	TRAJ_STATUS = 2,
+};
+
+#define TRAJ_SAMPLES_PER_PKT 2
+
+struct traj_cmd_append {
+	uint8_t kind;
+	uint8_t nsamples;
+	uint8_t pad[2];
+	struct traj_sample samples[TRAJ_SAMPLES_PER_PKT];
+};
+
+struct traj_status {
+	uint16_t free;
+	uint16_t count;
+	uint32_t n_underruns;
+	uint32_t n_late;
+	uint32_t last_time;
+	uint32_t now;
+};
+
+struct traj_cmd {
+	enum traj_type type;
+	union {
+		/* type == TRAJ_APPEND */
+		struct traj_cmd_append append;
+		/* Returned for all types */
+		struct traj_status status;
+	} payloads;
+};
+
+static void trajectory_append(struct traj_cmd_append *append)
+{
+	unsigned int i;
+
+	if (append->nsamples > TRAJ_SAMPLES_PER_PKT || append->kind > TRAJ_DRIVE) {
+		log_err("Bad trajectory append (%d, %d)\n", append->kind, append->nsamples);
+		return;
+	}
+
+	for (i = 0; i < append->nsamples; i++) {
+		struct traj_entry *e;
+
+		if (trajectory_count() >= TRAJECTORY_LEN) {
+			log_warn("Trajectory buffer full\n");
+			return;
+		}
+
+		e = &traj.buf[traj.head & (TRAJECTORY_LEN - 1)];
+		e->sample = append->samples[i];
+		e->kind = append->kind;
+		traj.head++;
+	}
+}
+
+void trajectory_process_packet(struct spi_pl_packet *pkt)
+{
+	struct traj_cmd *cmd = (struct traj_cmd *)pkt->data;
+	struct traj_status *status = &cmd->payloads.status;
+	uint32_t count;
+
+	if ((pkt->type != EP_TRAJECTORY) || (pkt->flags & SPI_FLAG_ERROR))
+		return;
+
+	if (cmd->type == TRAJ_APPEND) {
+		trajectory_append(&cmd->payloads.append);
+	} else if (cmd->type == TRAJ_CLEAR) {
+		traj.flush = true;
+	}
+
+	count = traj.flush ? 0 : trajectory_count();
+
+	memset(status, 0, sizeof(*status));
+	status->free = TRAJECTORY_LEN - count;
+	status->count = count;
+	status->n_underruns = traj.n_underruns;
+	status->n_late = traj.n_late;
+	status->last_time = traj.last_time;
+	status->now = msTicks;
+}
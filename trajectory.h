@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __TRAJECTORY_H__
+#define __TRAJECTORY_H__
+
+#include <stdint.h>
+
+#include "spi.h"
+
+/*
+ * Buffer of time-stamped setpoints, consumed by the control tick.
+ * Every packet sent to EP_TRAJECTORY is returned with the buffer status
+ * filled in, which the host can use for flow control.
+ */
+#define EP_TRAJECTORY 21
+
+/* Fills in pkt with the status. The caller should send it back */
+void trajectory_process_packet(struct spi_pl_packet *pkt);
+/* Call once per control tick, before the motors are updated */
+void trajectory_tick(uint32_t now);
+
+#endif /* __TRAJECTORY_H__ */